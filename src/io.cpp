@@ -17,79 +17,422 @@
 
 #include "winmd.h"
 #include <stddef.h>
-#include <emmintrin.h>
 
-static const int64_t flush_interval = 5;
+uint32_t stripe_cache_size = 128; // MB per array
+uint32_t flush_interval = 1000; // ms
+uint32_t flush_idle_time = 5000; // ms
+uint32_t flush_max_age = 30000; // ms
+uint32_t flush_dirty_percent = 50;
+uint32_t flush_batch = 32; // stripes
+uint32_t flush_stripes = 8; // stripes in flight at once
+uint32_t write_gather_time = 5; // ms
+uint32_t read_ahead_stripes = 2; // how far ahead of a sequential reader to go
+uint32_t read_ahead_cache_size = 32; // MB
+uint32_t raid1_split_size = 262144;
+uint32_t write_behind_size = 0; // 0 means don't
+PKEVENT low_memory_event = nullptr;
 
 NTSTATUS __stdcall io_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx) {
     auto context = (io_context*)ctx;
 
     context->iosb = Irp->IoStatus;
-    KeSetEvent(&context->Event, 0, FALSE);
+
+    if (context->timed)
+        context->sc->read_done(context->start_time);
+
+    if (context->parent)
+        context->parent->release(Irp->IoStatus.Status); // may free context
+    else
+        KeSetEvent(&context->Event, 0, FALSE);
 
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-void do_xor(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
-    uint32_t j;
-    __m128i x1, x2;
+// for RAID4/5/6 writes which we pass straight down to a member
+NTSTATUS __stdcall write_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx) {
+    auto sd = (set_pdo*)ctx;
+
+    if (Irp->PendingReturned)
+        IoMarkIrpPending(Irp);
+
+    InterlockedDecrement(&sd->writes_in_flight);
+    ExReleaseRundownProtection(&sd->io_rundown);
+
+    return STATUS_CONTINUE_COMPLETION;
+}
+
+// for other requests which we pass straight down to a member
+NTSTATUS __stdcall passthrough_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx) {
+    auto sd = (set_pdo*)ctx;
+
+    if (Irp->PendingReturned)
+        IoMarkIrpPending(Irp);
+
+    ExReleaseRundownProtection(&sd->io_rundown);
+
+    return STATUS_CONTINUE_COMPLETION;
+}
+
+void io_pool::init(CCHAR stack_size, uint32_t max_ctxs) {
+    irp_stack_size = stack_size;
+    this->max_ctxs = max_ctxs;
+    max_irps = max_ctxs * IO_POOL_DEPTH;
+
+    // each block is preceded by a pointer to the lookaside list it came from, see put
+    ExInitializeNPagedLookasideList(&ctxs_lookaside, nullptr, nullptr, 0, MEMORY_ALLOCATION_ALIGNMENT + (sizeof(io_context) * max_ctxs),
+                                    ALLOC_TAG, 0);
+    ExInitializeNPagedLookasideList(&parent_lookaside, nullptr, nullptr, 0, MEMORY_ALLOCATION_ALIGNMENT + sizeof(io_parent), ALLOC_TAG, 0);
+    ExInitializeNPagedLookasideList(&member_io_lookaside, nullptr, nullptr, 0, MEMORY_ALLOCATION_ALIGNMENT + sizeof(member_io), ALLOC_TAG, 0);
+
+    while (num_irps < max_irps) {
+        auto Irp = IoAllocateIrp(stack_size, false);
+        if (!Irp)
+            break;
+
+        InsertTailList(&irps, &Irp->Tail.Overlay.ListEntry);
+        num_irps++;
+    }
+
+    initialized = true;
+}
+
+io_pool::~io_pool() {
+    if (!initialized)
+        return;
+
+    while (!IsListEmpty(&irps)) {
+        IoFreeIrp(CONTAINING_RECORD(RemoveHeadList(&irps), IRP, Tail.Overlay.ListEntry));
+    }
+
+    ExDeleteNPagedLookasideList(&ctxs_lookaside);
+    ExDeleteNPagedLookasideList(&parent_lookaside);
+    ExDeleteNPagedLookasideList(&member_io_lookaside);
+
+    for (unsigned int i = 0; i < PARITY_POOL_CLASSES; i++) {
+        while (!IsListEmpty(&parity_bufs[i])) {
+            ExFreePool(RemoveHeadList(&parity_bufs[i]));
+        }
+    }
+}
+
+PIRP io_pool::get_irp(io_context& ctx) {
+    CCHAR stack_size = ctx.sc->device->StackSize;
+
+    ctx.pool = this;
+
+    if (initialized && stack_size <= irp_stack_size) {
+        auto le = ExInterlockedRemoveHeadList(&irps, &irp_lock);
+
+        if (le) {
+            InterlockedDecrement(&num_irps);
+            return CONTAINING_RECORD(le, IRP, Tail.Overlay.ListEntry);
+        }
+
+        stack_size = irp_stack_size; // so that put_irp can keep it
+    }
 
-    if (have_sse2 && ((uintptr_t)buf1 & 0xf) == 0 && ((uintptr_t)buf2 & 0xf) == 0) {
-        while (len >= 16) {
-            x1 = _mm_load_si128((__m128i*)buf1);
-            x2 = _mm_load_si128((__m128i*)buf2);
-            x1 = _mm_xor_si128(x1, x2);
-            _mm_store_si128((__m128i*)buf1, x1);
+    return IoAllocateIrp(stack_size, false);
+}
 
-            buf1 += 16;
-            buf2 += 16;
-            len -= 16;
+void io_pool::put_irp(PIRP Irp) {
+    if (initialized && Irp->StackCount == irp_stack_size) {
+        if (InterlockedIncrement(&num_irps) <= max_irps) {
+            IoReuseIrp(Irp, STATUS_SUCCESS);
+            ExInterlockedInsertHeadList(&irps, &Irp->Tail.Overlay.ListEntry, &irp_lock);
+            return;
         }
+
+        InterlockedDecrement(&num_irps);
+    }
+
+    IoFreeIrp(Irp);
+}
+
+static void* pool_alloc(NPAGED_LOOKASIDE_LIST* lookaside, size_t size) {
+    void** buf;
+
+    if (lookaside)
+        buf = (void**)ExAllocateFromNPagedLookasideList(lookaside);
+    else
+        buf = (void**)ExAllocatePoolWithTag(NonPagedPool, MEMORY_ALLOCATION_ALIGNMENT + size, ALLOC_TAG);
+
+    if (!buf)
+        return nullptr;
+
+    buf[0] = lookaside;
+
+    return (uint8_t*)buf + MEMORY_ALLOCATION_ALIGNMENT;
+}
+
+io_context* io_pool::get_ctxs(uint32_t num) {
+    auto ctxs = (io_context*)pool_alloc(initialized && num <= max_ctxs ? &ctxs_lookaside : nullptr, sizeof(io_context) * num);
+
+    if (ctxs)
+        RtlZeroMemory(ctxs, sizeof(io_context) * num);
+
+    return ctxs;
+}
+
+void* io_pool::get_parent(size_t size) {
+    return pool_alloc(initialized ? &parent_lookaside : nullptr, size);
+}
+
+// The smallest size class which length fits in, or -1 if it's too big, or too small for it to
+// be worth giving it a whole buffer of PARITY_POOL_MIN.
+static int parity_class(uint32_t length) {
+    if (length <= PARITY_POOL_MIN / 2)
+        return -1;
+
+    for (int i = 0; i < PARITY_POOL_CLASSES; i++) {
+        if (length <= (uint32_t)PARITY_POOL_MIN << i)
+            return i;
     }
 
-    while (len >= 4) {
-        *(uint32_t*)buf1 ^= *(uint32_t*)buf2;
-        buf1 += 4;
-        buf2 += 4;
-        len -= 4;
+    return -1;
+}
+
+// Unlike the other buffers, these have no header, as the write paths rely on them being
+// page-aligned. The caller has to give put_parity the same length as it gave get_parity.
+// We only keep a few of each size, and none at all while memory is low.
+uint8_t* io_pool::get_parity(uint32_t length) {
+    int cls = initialized ? parity_class(length) : -1;
+
+    if (cls != -1) {
+        auto le = ExInterlockedRemoveHeadList(&parity_bufs[cls], &parity_lock);
+
+        if (le) {
+            InterlockedDecrement(&num_parity_bufs[cls]);
+            return (uint8_t*)le;
+        }
+
+        length = PARITY_POOL_MIN << cls; // so that put_parity can keep it
     }
 
-    for (j = 0; j < len; j++) {
-        *buf1 ^= *buf2;
-        buf1++;
-        buf2++;
+    return (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, max(length, (uint32_t)PAGE_SIZE), ALLOC_TAG);
+}
+
+void io_pool::put_parity(uint8_t* buf, uint32_t length) {
+    int cls = initialized ? parity_class(length) : -1;
+
+    if (cls != -1 && !(low_memory_event && KeReadStateEvent(low_memory_event))) {
+        if (InterlockedIncrement(&num_parity_bufs[cls]) <= PARITY_POOL_DEPTH) {
+            ExInterlockedInsertHeadList(&parity_bufs[cls], (PLIST_ENTRY)buf, &parity_lock);
+            return;
+        }
+
+        InterlockedDecrement(&num_parity_bufs[cls]);
     }
+
+    ExFreePool(buf);
+}
+
+member_io* io_pool::get_member_io() {
+    return (member_io*)pool_alloc(initialized ? &member_io_lookaside : nullptr, sizeof(member_io));
+}
+
+void io_pool::put(void* p) {
+    auto buf = (void**)((uint8_t*)p - MEMORY_ALLOCATION_ALIGNMENT);
+    auto lookaside = (NPAGED_LOOKASIDE_LIST*)buf[0];
+
+    if (lookaside)
+        ExFreeToNPagedLookasideList(lookaside, buf);
+    else
+        ExFreePool(buf);
+}
+
+void* io_parent::operator new(size_t size, io_pool& pool) {
+    return pool.get_parent(size);
+}
+
+void io_parent::operator delete(void* p) {
+    io_pool::put(p);
 }
 
-static void do_and(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
-    uint32_t j;
-    __m128i x1, x2;
+void io_parent::operator delete(void* p, io_pool&) {
+    io_pool::put(p);
+}
 
-    if (have_sse2 && ((uintptr_t)buf1 & 0xf) == 0 && ((uintptr_t)buf2 & 0xf) == 0) {
-        while (len >= 16) {
-            x1 = _mm_load_si128((__m128i*)buf1);
-            x2 = _mm_load_si128((__m128i*)buf2);
-            x1 = _mm_and_si128(x1, x2);
-            _mm_store_si128((__m128i*)buf1, x1);
+io_parent::~io_parent() {
+    if (!mdl_locked)
+        MmUnlockPages(Irp->MdlAddress);
 
-            buf1 += 16;
-            buf2 += 16;
-            len -= 16;
+    if (ctxs) {
+        for (uint32_t i = 0; i < num_ctxs; i++) {
+            ctxs[i].io_context::~io_context();
         }
+
+        io_pool::put(ctxs);
+    }
+
+    if (tmpmdl)
+        IoFreeMdl(tmpmdl);
+
+    if (tmpbuf)
+        ExFreePool(tmpbuf);
+
+    if (dummy_mdl)
+        IoFreeMdl(dummy_mdl);
+
+    if (dummypage)
+        ExFreePool(dummypage);
+
+    if (parity_mdl)
+        IoFreeMdl(parity_mdl);
+
+    if (parity_data) {
+        if (parity_pool)
+            parity_pool->put_parity(parity_data, parity_alloc);
+        else
+            ExFreePool(parity_data);
+    }
+
+    if (q_mdl)
+        IoFreeMdl(q_mdl);
+
+    if (q_data) {
+        if (parity_pool)
+            parity_pool->put_parity(q_data, parity_alloc);
+        else
+            ExFreePool(q_data);
+    }
+
+    if (locked_set)
+        locked_set->unlock_stripes(&stripes);
+}
+
+NTSTATUS io_parent::call(io_context& ctx) {
+    ctx.parent = this;
+
+    InterlockedIncrement(&outstanding);
+
+    return IoCallDriver(ctx.sc->device, ctx.Irp);
+}
+
+void io_parent::release(NTSTATUS Status) {
+    if (!NT_SUCCESS(Status))
+        this->Status = Status;
+
+    if (InterlockedDecrement(&outstanding) == 0)
+        finish();
+}
+
+void io_parent::finish() {
+    if (copy_length != 0 && NT_SUCCESS(Status)) {
+        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        if (dest)
+            RtlCopyMemory(dest, tmpbuf + skip_first, copy_length);
+        else
+            Status = STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    while (len >= 4) {
-        *(uint32_t*)buf1 &= *(uint32_t*)buf2;
-        buf1 += 4;
-        buf2 += 4;
-        len -= 4;
+    if (waiting) {
+        KeSetEvent(&Event, 0, false);
+        return;
     }
 
-    for (j = 0; j < len; j++) {
-        *buf1 &= *buf2;
-        buf1++;
-        buf2++;
+    auto Irp = this->Irp;
+    auto rundown = this->rundown;
+
+    Irp->IoStatus.Status = Status;
+
+    if (in_flight)
+        InterlockedDecrement(in_flight);
+
+    delete this;
+
+    // the set may go away as soon as this is released
+    if (rundown)
+        ExReleaseRundownProtection(rundown);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+NTSTATUS io_parent::wait() {
+    waiting = true;
+
+    release(STATUS_SUCCESS);
+
+    KeWaitForSingleObject(&Event, Executive, KernelMode, false, nullptr);
+
+    return Status;
+}
+
+NTSTATUS io_parent::pend(bool* no_complete) {
+    IoMarkIrpPending(Irp);
+    *no_complete = true;
+
+    release(STATUS_SUCCESS);
+
+    return STATUS_PENDING;
+}
+
+#define SLOW_FACTOR 4 // how many times slower than the fastest copy a member has to be before we avoid it
+#define SLOW_MIN_TIME 2000 // microseconds - nothing quicker than this counts as slow
+
+void set_child::read_done(uint64_t start_time) {
+    auto latency = (LONG)min((KeQueryInterruptTime() - start_time) / 10, (uint64_t)MAXLONG);
+    LONG depth = reads_in_flight * 16;
+
+    // racing with another completion only loses a sample
+    latency_ewma += (latency - latency_ewma) / 8;
+    depth_ewma += (depth - depth_ewma) / 8;
+
+    InterlockedDecrement(&reads_in_flight);
+}
+
+// Roughly how long the member takes over a read, leaving out the time spent queued behind
+// its other reads.
+uint32_t set_child::service_time() {
+    LONG depth = max(depth_ewma, 16);
+
+    return (uint32_t)(((int64_t)latency_ewma * 16) / depth);
+}
+
+// A member which is taking much longer than the fastest copy, e.g. because it's retrying a
+// bad sector, gets left alone.
+bool set_child::slow(uint32_t time, uint32_t fastest) {
+    return time >= SLOW_MIN_TIME && time > (uint64_t)fastest * SLOW_FACTOR;
+}
+
+// As a slow member won't be sent any reads, its latency decays each time a read passes it
+// over, so that it gets tried again eventually.
+void set_child::passed_over() {
+    latency_ewma -= latency_ewma / 64;
+}
+
+static NTSTATUS __stdcall member_read_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx) {
+    auto mio = (member_io*)ctx;
+
+    if (Irp->PendingReturned)
+        IoMarkIrpPending(Irp);
+
+    auto sd = mio->sd;
+
+    mio->sc->read_done(mio->start_time);
+    io_pool::put(mio);
+
+    ExReleaseRundownProtection(&sd->io_rundown);
+
+    return STATUS_CONTINUE_COMPLETION;
+}
+
+// Called after IoCopyCurrentIrpStackLocationToNext, when we're passing a read straight down.
+// If we can't allocate the member_io, the read just goes untimed.
+void set_pdo::time_read(PIRP Irp, set_child* sc) {
+    auto mio = pool.get_member_io();
+    if (!mio) {
+        IoSetCompletionRoutine(Irp, passthrough_completion, this, true, true, true);
+        return;
     }
+
+    mio->sd = this;
+    mio->sc = sc;
+    mio->start_time = KeQueryInterruptTime();
+
+    InterlockedIncrement(&sc->reads_in_flight);
+
+    IoSetCompletionRoutine(Irp, member_read_completion, mio, true, true, true);
 }
 
 uint32_t set_pdo::get_parity_volume(uint64_t offset) {
@@ -136,333 +479,1963 @@ uint32_t set_pdo::get_physical_stripe(uint32_t stripe, uint32_t parity) {
     }
 }
 
-NTSTATUS set_device::read(PIRP Irp, bool* no_complete) {
-    TRACE("(%p)\n", Irp);
+#define READ_AHEAD_TRIGGER 2 // sequential reads before we start reading ahead
+
+struct read_ahead_job {
+    set_pdo* sd;
+    read_ahead_entry* ra;
+    PIO_WORKITEM work_item;
+};
+
+// Enough data to cover every member once, which is what we read ahead in. Zero if we don't
+// read ahead for this level.
+uint32_t set_pdo::read_ahead_width() {
+    if (array_info.chunksize == 0)
+        return 0;
+
+    switch (array_info.level) {
+        case RAID_LEVEL_0:
+        case RAID_LEVEL_10:
+            return array_info.chunksize * 512 * array_info.raid_disks;
+
+        case RAID_LEVEL_4:
+        case RAID_LEVEL_5:
+            return array_info.chunksize * 512 * (array_info.raid_disks - 1);
+
+        case RAID_LEVEL_6:
+            return array_info.chunksize * 512 * (array_info.raid_disks - 2);
+
+        default:
+            return 0;
+    }
+}
+
+void set_pdo::put_read_ahead(read_ahead_entry* ra) {
+    if (InterlockedDecrement(&ra->refcount) == 0)
+        ExFreePool(ra);
+}
+
+// called with read_ahead_lock held
+read_ahead_entry* set_pdo::find_read_ahead(uint64_t offset) {
+    LIST_ENTRY* le = read_ahead.Flink;
+
+    while (le != &read_ahead) {
+        auto ra = CONTAINING_RECORD(le, read_ahead_entry, list_entry);
+
+        if (ra->offset == offset)
+            return ra;
+
+        le = le->Flink;
+    }
+
+    return nullptr;
+}
+
+// called with read_ahead_lock held
+void set_pdo::drop_read_ahead(read_ahead_entry* ra) {
+    RemoveEntryList(&ra->list_entry);
+    read_ahead_size -= ra->length;
+    ra->dead = true;
+
+    put_read_ahead(ra);
+}
+
+void set_pdo::invalidate_read_ahead(uint64_t offset, uint64_t length) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&read_ahead_lock, &irql);
+
+    LIST_ENTRY* le = read_ahead.Flink;
+    while (le != &read_ahead) {
+        auto ra = CONTAINING_RECORD(le, read_ahead_entry, list_entry);
+        LIST_ENTRY* le2 = le->Flink;
+
+        if (ra->offset < offset + length && ra->offset + ra->length > offset)
+            drop_read_ahead(ra);
+
+        le = le2;
+    }
+
+    KeReleaseSpinLock(&read_ahead_lock, irql);
+}
+
+static NTSTATUS __stdcall read_ahead_completion(PDEVICE_OBJECT, PIRP, PVOID ctx) {
+    KeSetEvent((PKEVENT)ctx, 0, false);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+// We send the read through the set's own read functions, so that RAID4/5/6 picks up
+// anything in the stripe cache and copes with a missing member.
+void set_pdo::read_ahead_worker(PDEVICE_OBJECT, PVOID context) {
+    auto job = (read_ahead_job*)context;
+    auto sd = job->sd;
+    auto ra = job->ra;
+    bool no_complete = false;
+    NTSTATUS Status;
+    KEVENT Event;
+    KIRQL irql;
+
+    KeInitializeEvent(&Event, NotificationEvent, false);
+
+    auto Irp = IoAllocateIrp(sd->dev->devobj->StackSize, false);
+    if (!Irp) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    Irp->MdlAddress = IoAllocateMdl(ra->data, ra->length, false, false, nullptr);
+    if (!Irp->MdlAddress) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        IoFreeIrp(Irp);
+        goto end;
+    }
+
+    Status = STATUS_SUCCESS;
+
+    seh_try {
+        MmProbeAndLockPages(Irp->MdlAddress, KernelMode, IoWriteAccess);
+    } seh_except (EXCEPTION_EXECUTE_HANDLER) {
+        Status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("MmProbeAndLockPages threw exception %08x\n", Status);
+        IoFreeMdl(Irp->MdlAddress);
+        IoFreeIrp(Irp);
+        goto end;
+    }
+
+    IoSetCompletionRoutine(Irp, read_ahead_completion, &Event, true, true, true);
+    IoSetNextIrpStackLocation(Irp);
+
+    {
+        auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+        IrpSp->MajorFunction = IRP_MJ_READ;
+        IrpSp->DeviceObject = sd->dev->devobj;
+        IrpSp->Parameters.Read.ByteOffset.QuadPart = ra->offset;
+        IrpSp->Parameters.Read.Length = ra->length;
+    }
+
+    // the read needs a reference of its own, as whatever completes it will release it
+    if (!ExAcquireRundownProtection(&sd->io_rundown)) {
+        Status = STATUS_DEVICE_NOT_READY;
+        MmUnlockPages(Irp->MdlAddress);
+        IoFreeMdl(Irp->MdlAddress);
+        IoFreeIrp(Irp);
+        goto end;
+    }
+
+    switch (sd->array_info.level) {
+        case RAID_LEVEL_0:
+            Status = sd->read_raid0(Irp, &no_complete);
+            break;
+
+        case RAID_LEVEL_4:
+        case RAID_LEVEL_5:
+            Status = sd->read_raid45(Irp, &no_complete);
+            break;
+
+        case RAID_LEVEL_6:
+            Status = sd->read_raid6(Irp, &no_complete);
+            break;
+
+        case RAID_LEVEL_10:
+            Status = sd->read_raid10(Irp, &no_complete);
+            break;
+
+        default:
+            Status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    if (no_complete) {
+        KeWaitForSingleObject(&Event, Executive, KernelMode, false, nullptr);
+        Status = Irp->IoStatus.Status;
+    } else
+        ExReleaseRundownProtection(&sd->io_rundown);
+
+    MmUnlockPages(Irp->MdlAddress);
+    IoFreeMdl(Irp->MdlAddress);
+    IoFreeIrp(Irp);
+
+end:
+    KeAcquireSpinLock(&sd->read_ahead_lock, &irql);
+
+    if (!ra->dead) {
+        if (NT_SUCCESS(Status))
+            ra->ready = true;
+        else
+            sd->drop_read_ahead(ra);
+    }
+
+    KeReleaseSpinLock(&sd->read_ahead_lock, irql);
+
+    sd->put_read_ahead(ra);
+
+    IoFreeWorkItem(job->work_item);
+    ExFreePool(job);
+
+    ExReleaseRundownProtection(&sd->io_rundown);
+}
+
+void set_pdo::start_read_ahead(uint64_t offset, uint32_t width) {
+    uint64_t limit = (uint64_t)read_ahead_cache_size * 1048576;
+    KIRQL irql;
+
+    if (offset >= array_size || width > limit)
+        return;
+
+    if (low_memory_event && KeReadStateEvent(low_memory_event))
+        return;
+
+    uint32_t length = (uint32_t)min(width, array_size - offset);
+
+    KeAcquireSpinLock(&read_ahead_lock, &irql);
+    bool found = find_read_ahead(offset);
+    KeReleaseSpinLock(&read_ahead_lock, irql);
+
+    if (found)
+        return;
+
+    auto ra = (read_ahead_entry*)ExAllocatePoolWithTag(NonPagedPool, offsetof(read_ahead_entry, data[0]) + length, ALLOC_TAG);
+    if (!ra)
+        return;
+
+    auto job = (read_ahead_job*)ExAllocatePoolWithTag(NonPagedPool, sizeof(read_ahead_job), ALLOC_TAG);
+    if (!job) {
+        ExFreePool(ra);
+        return;
+    }
+
+    job->work_item = IoAllocateWorkItem(pdo);
+    if (!job->work_item) {
+        ExFreePool(job);
+        ExFreePool(ra);
+        return;
+    }
+
+    ra->offset = offset;
+    ra->length = length;
+    ra->refcount = 2;
+    ra->ready = false;
+    ra->dead = false;
+
+    job->sd = this;
+    job->ra = ra;
+
+    // released by the worker
+    if (!ExAcquireRundownProtection(&io_rundown)) {
+        IoFreeWorkItem(job->work_item);
+        ExFreePool(job);
+        ExFreePool(ra);
+        return;
+    }
+
+    KeAcquireSpinLock(&read_ahead_lock, &irql);
+
+    // make room, throwing out the least recently used entries which aren't still being read
+    LIST_ENTRY* le = read_ahead.Flink;
+    while (read_ahead_size + length > limit && le != &read_ahead) {
+        auto ra2 = CONTAINING_RECORD(le, read_ahead_entry, list_entry);
+        LIST_ENTRY* le2 = le->Flink;
+
+        if (ra2->ready)
+            drop_read_ahead(ra2);
+
+        le = le2;
+    }
+
+    // A write which started before the entry went in might land after we've read the
+    // disk, so we don't read ahead while there's any write outstanding. Writes which start
+    // later will find the entry and invalidate it.
+    if (find_read_ahead(offset) || read_ahead_size + length > limit || InterlockedCompareExchange(&writes_in_flight, 0, 0) != 0) {
+        KeReleaseSpinLock(&read_ahead_lock, irql);
+
+        ExReleaseRundownProtection(&io_rundown);
+
+        IoFreeWorkItem(job->work_item);
+        ExFreePool(job);
+        ExFreePool(ra);
+        return;
+    }
+
+    InsertTailList(&read_ahead, &ra->list_entry);
+    read_ahead_size += length;
+
+    KeReleaseSpinLock(&read_ahead_lock, irql);
+
+    IoQueueWorkItem(job->work_item, read_ahead_worker, DelayedWorkQueue, job);
+}
+
+// Reads which carry on from where an earlier one finished are taken to be part of a stream.
+// Once a stream has been going for a little while, we start reading whole stripes ahead of
+// it, so that every member is kept busy rather than just the one the reader is on. Returns
+// true if the read could be satisfied from what we've already read.
+bool set_pdo::read_ahead_hit(PIRP Irp) {
+    auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
+    uint32_t length = IrpSp->Parameters.Read.Length;
+    uint32_t width = read_ahead_width();
+    read_ahead_entry* ras[2];
+    uint32_t num_ras = 0;
+    read_stream* rs = nullptr;
+    bool hit = length <= width;
+    KIRQL irql;
+
+    if (read_ahead_stripes == 0 || width == 0)
+        return false;
+
+    KeAcquireSpinLock(&read_ahead_lock, &irql);
+
+    for (unsigned int i = 0; i < MAX_READ_STREAMS; i++) {
+        if (streams[i].last_used != 0 && streams[i].next == offset) {
+            rs = &streams[i];
+            rs->hits++;
+            break;
+        }
+    }
+
+    if (!rs) {
+        rs = &streams[0];
+
+        for (unsigned int i = 1; i < MAX_READ_STREAMS; i++) {
+            if (streams[i].last_used < rs->last_used)
+                rs = &streams[i];
+        }
+
+        rs->hits = 0;
+    }
+
+    rs->next = offset + length;
+    rs->last_used = ++stream_clock;
+
+    bool sequential = rs->hits >= READ_AHEAD_TRIGGER;
+
+    // as entries are aligned to width, the read can't straddle more than two
+    for (uint64_t pos = offset - (offset % width); hit && pos < offset + length; pos += width) {
+        auto ra = find_read_ahead(pos);
+
+        if (ra && ra->ready) {
+            ras[num_ras] = ra;
+            num_ras++;
+        } else
+            hit = false;
+    }
+
+    if (hit) {
+        for (uint32_t i = 0; i < num_ras; i++) {
+            InterlockedIncrement(&ras[i]->refcount);
+
+            RemoveEntryList(&ras[i]->list_entry);
+            InsertTailList(&read_ahead, &ras[i]->list_entry);
+        }
+    }
+
+    KeReleaseSpinLock(&read_ahead_lock, irql);
+
+    if (hit) {
+        auto dest = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+        if (!dest)
+            hit = false;
+        else {
+            uint32_t pos = 0;
+
+            for (uint32_t i = 0; i < num_ras; i++) {
+                uint32_t off = offset + pos > ras[i]->offset ? (uint32_t)(offset + pos - ras[i]->offset) : 0;
+                uint32_t len = min(length - pos, ras[i]->length - off);
+
+                RtlCopyMemory(dest + pos, ras[i]->data + off, len);
+                pos += len;
+            }
+        }
+
+        KeAcquireSpinLock(&read_ahead_lock, &irql);
+
+        for (uint32_t i = 0; i < num_ras; i++) {
+            // a stream won't come back for what it's already read
+            if (hit && !ras[i]->dead && offset + length >= ras[i]->offset + ras[i]->length)
+                drop_read_ahead(ras[i]);
+
+            put_read_ahead(ras[i]);
+        }
+
+        KeReleaseSpinLock(&read_ahead_lock, irql);
+    }
+
+    if (sequential) {
+        uint64_t next = offset + length;
+
+        next -= next % width;
+
+        for (uint32_t i = 0; i <= read_ahead_stripes; i++) {
+            start_read_ahead(next + ((uint64_t)i * width), width);
+        }
+    }
+
+    return hit;
+}
+
+NTSTATUS set_device::read_set(PIRP Irp, bool* no_complete) {
+    if (pdo->read_ahead_hit(Irp))
+        return STATUS_SUCCESS;
+
+    switch (pdo->array_info.level) {
+        case RAID_LEVEL_0:
+            return pdo->read_raid0(Irp, no_complete);
+
+        case RAID_LEVEL_1:
+            return pdo->read_raid1(Irp, no_complete);
+
+        case RAID_LEVEL_4:
+        case RAID_LEVEL_5:
+            return pdo->read_raid45(Irp, no_complete);
+
+        case RAID_LEVEL_6:
+            return pdo->read_raid6(Irp, no_complete);
+
+        case RAID_LEVEL_10:
+            return pdo->read_raid10(Irp, no_complete);
+
+        case RAID_LEVEL_LINEAR:
+            return pdo->read_linear(Irp, no_complete);
+
+        default:
+            return STATUS_INVALID_DEVICE_REQUEST;
+    }
+}
+
+NTSTATUS set_device::read(PIRP Irp, bool* no_complete) {
+    TRACE("(%p)\n", Irp);
+
+    if (!pdo)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    if (!pdo->loaded)
+        return STATUS_DEVICE_NOT_READY;
+
+    auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+    if (IrpSp->Parameters.Read.ByteOffset.QuadPart < 0) {
+        WARN("read start is negative\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((uint64_t)IrpSp->Parameters.Read.ByteOffset.QuadPart >= pdo->array_size) {
+        WARN("trying to read past end of device\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((uint64_t)IrpSp->Parameters.Read.ByteOffset.QuadPart + IrpSp->Parameters.Read.Length > pdo->array_size)
+        IrpSp->Parameters.Read.Length = (ULONG)(pdo->array_size - IrpSp->Parameters.Read.ByteOffset.QuadPart);
+
+    if (IrpSp->Parameters.Read.ByteOffset.QuadPart % devobj->SectorSize || IrpSp->Parameters.Read.Length % devobj->SectorSize)
+        return STATUS_INVALID_PARAMETER;
+
+    Irp->IoStatus.Information = IrpSp->Parameters.Read.Length;
+
+    if (IrpSp->Parameters.Read.Length == 0)
+        return STATUS_SUCCESS;
+
+    // released by whatever completes the request, so that the members stay around until then
+    if (!ExAcquireRundownProtection(&pdo->io_rundown))
+        return STATUS_DEVICE_NOT_READY;
+
+    auto Status = read_set(Irp, no_complete);
+
+    if (!*no_complete)
+        ExReleaseRundownProtection(&pdo->io_rundown);
+
+    return Status;
+}
+
+NTSTATUS device::read(PIRP, bool*) {
+    return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+NTSTATUS drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    NTSTATUS Status;
+    bool top_level;
+
+    FsRtlEnterFileSystem();
+
+    top_level = is_top_level(Irp);
+
+    auto dev = (device*)DeviceObject->DeviceExtension;
+
+    bool no_complete = false;
+
+    Status = dev->read(Irp, &no_complete);
+
+    if (!no_complete) {
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    if (top_level)
+        IoSetTopLevelIrp(nullptr);
+
+    FsRtlExitFileSystem();
+
+    return Status;
+}
+
+NTSTATUS set_pdo::sync_io(klist<io_context>& ctxs, bool write) {
+    if (ctxs.empty())
+        return STATUS_SUCCESS;
+
+    LIST_ENTRY* le = ctxs.list.Flink;
+    while (le != &ctxs.list) {
+        auto& ctx = ctxs.entry(le);
+        auto len = (ULONG)(ctx.stripe_end - ctx.stripe_start);
+
+        auto IrpSp = IoGetNextIrpStackLocation(ctx.Irp);
+        IrpSp->MajorFunction = write ? IRP_MJ_WRITE : IRP_MJ_READ;
+
+        ctx.mdl = IoAllocateMdl(ctx.va2, len, false, false, nullptr);
+        if (!ctx.mdl) {
+            ERR("IoAllocateMdl failed\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        MmBuildMdlForNonPagedPool(ctx.mdl);
+
+        ctx.Irp->MdlAddress = ctx.mdl;
+
+        IrpSp->FileObject = ctx.sc->fileobj;
+
+        if (write) {
+            IrpSp->Parameters.Write.ByteOffset.QuadPart = ctx.stripe_start;
+            IrpSp->Parameters.Write.Length = len;
+        } else {
+            IrpSp->Parameters.Read.ByteOffset.QuadPart = ctx.stripe_start;
+            IrpSp->Parameters.Read.Length = len;
+        }
+
+        le = le->Flink;
+    }
+
+    io_parent parent(nullptr);
+
+    le = ctxs.list.Flink;
+    while (le != &ctxs.list) {
+        parent.call(ctxs.entry(le));
+
+        le = le->Flink;
+    }
+
+    return parent.wait();
+}
+
+// Adds a context for each run of rows of pc which have been written to, for P and,
+// if q isn't null, for Q. p and q are chunk-sized buffers.
+NTSTATUS set_pdo::add_parity_ctxs(klist<io_context>& ctxs, partial_chunk* pc, RTL_BITMAP* valid_bmp, uint8_t* p, uint8_t* q) {
+    ULONG index;
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    auto parity = get_parity_volume(pc->offset);
+    auto runlength = RtlFindFirstRunClear(valid_bmp, &index);
+
+    while (runlength != 0) {
+        for (unsigned int i = 0; i < (q ? 2 : 1); i++) {
+            auto sc = child_list[(parity + i) % array_info.raid_disks];
+            uint64_t stripe_start = (pc->offset / data_disks) + (index * pc_block) + (sc->disk_info.data_offset * 512);
+
+            ctxs.emplace_back_np(sc, stripe_start, stripe_start + (runlength * pc_block), &pool);
+
+            auto last = &ctxs.back();
+
+            if (!NT_SUCCESS(last->Status)) {
+                ERR("io_context constructor returned %08x\n", last->Status);
+                return last->Status;
+            }
+
+            last->va2 = (i == 0 ? p : q) + (index * pc_block);
+        }
+
+        runlength = RtlFindNextForwardRunClear(valid_bmp, index + runlength, &index);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Adds a context for each run of blocks of pc between offset and offset + length which have
+// been written to, if written is set, or which haven't, if it isn't. Each block goes to or
+// from the same place in buf as it has in pc->data.
+NTSTATUS set_pdo::add_block_ctxs(klist<io_context>& ctxs, partial_chunk* pc, uint32_t offset, uint32_t length, bool written, uint8_t* buf) {
+    io_context* last = nullptr;
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    auto parity = get_parity_volume(pc->offset);
+
+    for (ULONG s = offset / pc_block; s < sector_align(offset + length, pc_block) / pc_block; s++) {
+        bool unwritten = RtlCheckBit(&pc->bmp, s);
+
+        if (unwritten == written)
+            continue;
+
+        auto sc = child_list[get_physical_stripe(s / pc_rows, parity)];
+        uint64_t stripe_start = (pc->offset / data_disks) + ((s % pc_rows) * pc_block) + (sc->disk_info.data_offset * 512);
+
+        if (last && last->sc == sc && last->stripe_end == stripe_start)
+            last->stripe_end += pc_block;
+        else {
+            ctxs.emplace_back_np(sc, stripe_start, stripe_start + pc_block, &pool);
+            last = &ctxs.back();
+
+            if (!NT_SUCCESS(last->Status)) {
+                ERR("io_context constructor returned %08x\n", last->Status);
+                return last->Status;
+            }
+
+            last->va2 = buf + (s * pc_block);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Reads into buf what's currently on disk for the blocks of pc between offset and
+// offset + length which haven't been written to yet.
+NTSTATUS set_pdo::read_old_data(partial_chunk* pc, uint32_t offset, uint32_t length, uint8_t* buf) {
+    klist<io_context> ctxs;
+
+    NTSTATUS Status = add_block_ctxs(ctxs, pc, offset, length, false, buf);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    return sync_io(ctxs, false);
+}
+
+#define IO_COST_SECTORS 8 // each request to a member costs about as much as transferring 4 KB
+
+// Works out whether read-modify-write or reconstruct-write would be cheaper for pc, as md does.
+// RMW reads the parity for each run of rows we've touched, and the old data of each run of
+// sectors we've written; reconstruct-write reads each run of sectors in those rows that we
+// haven't written. Both write the same, so that doesn't come into it.
+bool set_pdo::rmw_cheaper(partial_chunk* pc, RTL_BITMAP* valid_bmp) {
+    uint32_t parity_disks = array_info.level == RAID_LEVEL_6 ? 2 : 1;
+    uint32_t data_disks = array_info.raid_disks - parity_disks;
+    uint32_t rmw_ios = 0, rmw_sectors = 0, rcw_ios = 0, rcw_sectors = 0;
+    ULONG index;
+    auto runlength = RtlFindFirstRunClear(valid_bmp, &index);
+
+    while (runlength != 0) {
+        rmw_ios += parity_disks;
+        rmw_sectors += runlength * parity_disks;
+
+        for (uint32_t i = 0; i < data_disks; i++) {
+            bool in_rcw_run = false, in_rmw_run = false;
+
+            for (uint32_t j = index; j < index + runlength; j++) {
+                if (RtlCheckBit(&pc->bmp, (i * pc_rows) + j)) {
+                    if (!in_rcw_run)
+                        rcw_ios++;
+
+                    rcw_sectors++;
+                    in_rcw_run = true;
+                    in_rmw_run = false;
+                } else {
+                    if (!in_rmw_run)
+                        rmw_ios++;
+
+                    rmw_sectors++;
+                    in_rmw_run = true;
+                    in_rcw_run = false;
+                }
+            }
+        }
+
+        runlength = RtlFindNextForwardRunClear(valid_bmp, index + runlength, &index);
+    }
+
+    rmw_sectors *= pc_block / 512;
+    rcw_sectors *= pc_block / 512;
+
+    return (rmw_ios * IO_COST_SECTORS) + rmw_sectors < (rcw_ios * IO_COST_SECTORS) + rcw_sectors;
+}
+
+// Partial chunks track what's been written in blocks of the member sector size, or of a
+// page if that's bigger, so that for 4K I/O there's one bit and one request per page
+// rather than per 512 bytes.
+void set_pdo::init_partial_chunks() {
+    if (array_info.chunksize == 0)
+        return;
+
+    pc_block = min(max((uint32_t)dev_sector_size, (uint32_t)PAGE_SIZE), array_info.chunksize * 512);
+    pc_rows = array_info.chunksize * 512 / pc_block;
+}
+
+// The stripe stays locked while we flush it, so that a full-stripe write can't change its data
+// or parity between us reading them and writing the new parity.
+NTSTATUS set_pdo::flush_partial_chunk(partial_chunk* pc) {
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    stripe_lock sl;
+
+    lock_stripes(&sl, pc->offset, array_info.chunksize * 512 * data_disks);
+
+    NTSTATUS Status = flush_locked_chunk(pc);
+
+    unlock_stripes(&sl);
+
+    return Status;
+}
+
+NTSTATUS set_pdo::flush_locked_chunk(partial_chunk* pc) {
+    NTSTATUS Status;
+
+    TRACE("(%llx)\n", pc->offset);
+
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t chunk_size = array_info.chunksize * 512;
+    bool asymmetric = array_info.layout == RAID_LAYOUT_LEFT_ASYMMETRIC || array_info.layout == RAID_LAYOUT_RIGHT_ASYMMETRIC;
+
+    np_buffer valid(sector_align(pc_rows, 32) / 8);
+    if (!valid.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RTL_BITMAP valid_bmp;
+
+    RtlInitializeBitMap(&valid_bmp, (ULONG*)valid.buf, pc_rows);
+
+    if (pc_rows % 8 == 0) {
+        RtlCopyMemory(valid.buf, pc->bmp.Buffer, pc_rows / 8);
+
+        for (uint32_t i = 1; i < data_disks; i++) {
+            do_and(valid.buf, (uint8_t*)pc->bmp.Buffer + (i * pc_rows / 8), pc_rows / 8);
+        }
+    } else { // columns aren't byte-aligned, but there's only a few bits in each
+        RtlClearAllBits(&valid_bmp);
+
+        for (uint32_t i = 0; i < data_disks; i++) {
+            for (uint32_t j = 0; j < pc_rows; j++) {
+                if (RtlCheckBit(&pc->bmp, (i * pc_rows) + j))
+                    RtlSetBits(&valid_bmp, j, 1);
+            }
+        }
+    }
+
+    // Unless some of the new data has already gone to disk, we can update the parity by
+    // reading just the old data and parity, rather than the rest of the rows we've touched.
+    if (!pc->written_through && rmw_cheaper(pc, &valid_bmp)) {
+        if (array_info.level == RAID_LEVEL_6)
+            return flush_partial_chunk_raid6_rmw(pc, &valid_bmp);
+        else
+            return flush_partial_chunk_raid45_rmw(pc, &valid_bmp);
+    }
+
+    {
+        klist<io_context> ctxs;
+
+        auto parity = get_parity_volume(pc->offset);
+        uint32_t stripe = get_physical_stripe(0, parity);
+
+        for (uint32_t i = 0; i < data_disks; i++) {
+            ULONG index;
+            io_context* last = nullptr;
+            auto runlength = RtlFindFirstRunClear(&valid_bmp, &index);
+
+            while (runlength != 0) {
+                for (uint32_t j = index; j < index + runlength; j++) {
+                    if (RtlCheckBit(&pc->bmp, (i * pc_rows) + j)) {
+                        uint64_t stripe_start = (pc->offset / data_disks) + (j * pc_block) + (child_list[stripe]->disk_info.data_offset * 512);
+
+                        if (last && last->stripe_end == stripe_start)
+                            last->stripe_end += pc_block;
+                        else {
+                            ctxs.emplace_back_np(child_list[stripe], stripe_start, stripe_start + pc_block, &pool);
+                            last = &ctxs.back();
+
+                            if (!NT_SUCCESS(last->Status)) {
+                                ERR("io_context constructor returned %08x\n", last->Status);
+                                return last->Status;
+                            }
+
+                            last->va2 = pc->data + (i * chunk_size) + (j * pc_block);
+                        }
+                    }
+                }
+
+                runlength = RtlFindNextForwardRunClear(&valid_bmp, index + runlength, &index);
+            }
+
+            if (asymmetric) {
+                stripe++;
+
+                if (stripe == parity) {
+                    if (array_info.level == RAID_LEVEL_6)
+                        stripe += 2;
+                    else
+                        stripe++;
+                }
+            } else
+                stripe = (stripe + 1) % array_info.raid_disks;
+        }
+
+        if (!ctxs.empty()) {
+            LIST_ENTRY* le = ctxs.list.Flink;
+            while (le != &ctxs.list) {
+                auto& ctx = ctxs.entry(le);
+
+                auto IrpSp = IoGetNextIrpStackLocation(ctx.Irp);
+                IrpSp->MajorFunction = IRP_MJ_READ;
+
+                ctx.mdl = IoAllocateMdl(ctx.va2, (ULONG)(ctx.stripe_end - ctx.stripe_start), false, false, nullptr);
+                if (!ctx.mdl) {
+                    ERR("IoAllocateMdl failed\n");
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                MmBuildMdlForNonPagedPool(ctx.mdl);
+
+                ctx.Irp->MdlAddress = ctx.mdl;
+
+                IrpSp->FileObject = ctx.sc->fileobj;
+                IrpSp->Parameters.Read.ByteOffset.QuadPart = ctx.stripe_start;
+                IrpSp->Parameters.Read.Length = (ULONG)(ctx.stripe_end - ctx.stripe_start);
+
+                le = le->Flink;
+            }
+
+            io_parent parent(nullptr);
+
+            le = ctxs.list.Flink;
+            while (le != &ctxs.list) {
+                parent.call(ctxs.entry(le));
+
+                le = le->Flink;
+            }
+
+            Status = parent.wait();
+            if (!NT_SUCCESS(Status)) {
+                ERR("reading returned %08x\n", Status);
+                return Status;
+            }
+        }
+    }
+
+    if (array_info.level == RAID_LEVEL_6)
+        return flush_partial_chunk_raid6(pc, &valid_bmp);
+    else
+        return flush_partial_chunk_raid45(pc, &valid_bmp);
+}
+
+static worker_pool flush_workers;
+
+struct flush_job : worker_job {
+    set_pdo* sd;
+    partial_chunk* pc;
+    LONG* outstanding;
+    KEVENT* Event;
+};
+
+void set_pdo::flush_worker(worker_job* wj) {
+    auto job = (flush_job*)wj;
+
+    NTSTATUS Status = job->sd->flush_partial_chunk(job->pc);
+    if (!NT_SUCCESS(Status))
+        ERR("flush_partial_chunk returned %08x\n", Status);
+
+    if (InterlockedDecrement(job->outstanding) == 0)
+        KeSetEvent(job->Event, 0, false);
+}
+
+// One fewer than the most stripes a flusher has in flight, as it does one itself.
+void start_flush_workers() {
+    flush_workers.start(max(min(flush_stripes, MAX_FLUSH_STRIPES), 1) - 1);
+
+    TRACE("started %u flush worker threads\n", flush_workers.num_workers);
+}
+
+void stop_flush_workers() {
+    flush_workers.stop();
+}
+
+// Flushes several stripes at once, so that the reads for one overlap the parity calculation
+// and writes of another. All but the first go to the flush worker threads, and while we wait
+// we take jobs back off the queue ourselves; if there aren't any threads, we do them all in turn.
+// The chunks need to have come from lock_for_flush, and are taken out of the cache, unlocked and
+// released afterwards.
+void set_pdo::flush_partial_chunks(partial_chunk** pcs, uint32_t num) {
+    LONG outstanding = 0;
+    KEVENT Event;
+    np_buffer jobbuf(sizeof(flush_job) * num);
+    auto jobs = (flush_job*)jobbuf.buf;
+    bool queued = num > 1 && jobs && flush_workers.num_workers > 0;
+    NTSTATUS Status;
+
+    KeInitializeEvent(&Event, NotificationEvent, false);
+
+    if (queued) {
+        LIST_ENTRY list;
+
+        InitializeListHead(&list);
+
+        outstanding = num - 1;
+
+        for (uint32_t i = 1; i < num; i++) {
+            jobs[i].func = flush_worker;
+            jobs[i].sd = this;
+            jobs[i].pc = pcs[i];
+            jobs[i].outstanding = &outstanding;
+            jobs[i].Event = &Event;
+
+            InsertTailList(&list, &jobs[i].list_entry);
+        }
+
+        flush_workers.queue(&list, num - 1);
+    } else {
+        for (uint32_t i = 1; i < num; i++) {
+            Status = flush_partial_chunk(pcs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("flush_partial_chunk returned %08x\n", Status);
+        }
+    }
+
+    Status = flush_partial_chunk(pcs[0]);
+    if (!NT_SUCCESS(Status))
+        ERR("flush_partial_chunk returned %08x\n", Status);
+
+    if (queued) {
+        // these might belong to another set
+        while (outstanding > 0) {
+            auto job = flush_workers.dequeue();
+
+            if (!job)
+                break;
+
+            job->func(job);
+        }
+
+        KeWaitForSingleObject(&Event, Executive, KernelMode, false, nullptr);
+    }
+
+    for (uint32_t i = 0; i < num; i++) {
+        remove_partial_chunk(pcs[i]);
+        ExReleaseResourceLite(&pcs[i]->lock);
+        put_partial_chunk(pcs[i]);
+    }
+}
+
+// Locks the chunks in pcs, which the caller holds references to, for flush_partial_chunks. They
+// stay in the cache until they've been flushed, so that reads and writes of the same stripes
+// find them and wait, rather than going to disks which don't have their data yet. Flushers hold several chunk
+// locks at once, so to avoid deadlocks we skip any which are busy - unless wait is set, which is
+// only safe if we're not holding any others. Returns how many are left in pcs. If counters is
+// given, it's kept in step with pcs.
+uint32_t set_pdo::lock_for_flush(partial_chunk** pcs, uint32_t num, bool wait, LONG64** counters) {
+    uint32_t locked = 0;
+
+    for (uint32_t i = 0; i < num; i++) {
+        auto pc = pcs[i];
+
+        if (ExAcquireResourceExclusiveLite(&pc->lock, wait)) {
+            if (!pc->dead) {
+                pcs[locked] = pc;
+
+                if (counters)
+                    counters[locked] = counters[i];
+
+                locked++;
+                continue;
+            }
+
+            ExReleaseResourceLite(&pc->lock);
+        }
+
+        put_partial_chunk(pc);
+    }
+
+    InterlockedExchangeAdd64(&flush_stats.busy, num - locked);
+
+    return locked;
+}
+
+void set_pdo::flush_chunks() {
+    uint32_t group = max(min(flush_stripes, MAX_FLUSH_STRIPES), 1);
+
+    while (true) {
+        partial_chunk* pcs[MAX_FLUSH_STRIPES];
+        uint32_t num = 0;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&partial_chunks_lock, &irql);
+
+        LIST_ENTRY* le = partial_chunks.Flink;
+        while (le != &partial_chunks && num < group) {
+            pcs[num] = CONTAINING_RECORD(le, partial_chunk, list_entry);
+            InterlockedIncrement(&pcs[num]->refcount);
+            num++;
+
+            le = le->Flink;
+        }
+
+        KeReleaseSpinLock(&partial_chunks_lock, irql);
+
+        if (num == 0)
+            break;
+
+        num = lock_for_flush(pcs, num, false);
+
+        // if they're all busy, wait for the oldest
+        if (num == 0) {
+            KeAcquireSpinLock(&partial_chunks_lock, &irql);
+
+            if (!IsListEmpty(&partial_chunks)) {
+                pcs[0] = CONTAINING_RECORD(partial_chunks.Flink, partial_chunk, list_entry);
+                InterlockedIncrement(&pcs[0]->refcount);
+                num = 1;
+            }
+
+            KeReleaseSpinLock(&partial_chunks_lock, irql);
+
+            if (num == 0)
+                break;
+
+            num = lock_for_flush(pcs, 1, true);
+        }
+
+        if (num > 0)
+            flush_partial_chunks(pcs, num);
+    }
+}
+
+// Rather than flushing everything at once, we leave stripes alone until they've gone
+// flush_idle_time without a write, in case the rest of the stripe turns up, or until they've
+// been dirty for flush_max_age. To spread the work out, we only do flush_batch of these each
+// time round. If the cache is more than flush_dirty_percent full, we flush the least recently
+// used regardless.
+void set_pdo::flush_idle_chunks() {
+    uint32_t group = max(min(flush_stripes, MAX_FLUSH_STRIPES), 1);
+    uint32_t done = 0;
+    bool flushed = false;
+
+    while (true) {
+        partial_chunk* pcs[MAX_FLUSH_STRIPES];
+        LONG64* reasons[MAX_FLUSH_STRIPES];
+        uint32_t num = 0;
+        uint64_t selected = 0;
+        uint64_t now = KeQueryInterruptTime();
+        uint64_t dirty_limit = (uint64_t)stripe_cache_size * 1048576 * flush_dirty_percent / 100;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&partial_chunks_lock, &irql);
+
+        LIST_ENTRY* le = partial_chunks.Flink;
+        while (le != &partial_chunks && num < group) {
+            auto pc = CONTAINING_RECORD(le, partial_chunk, list_entry);
+
+            le = le->Flink;
+
+            bool dirty = partial_chunks_size - selected > dirty_limit;
+
+            if (dirty)
+                reasons[num] = &flush_stats.dirty;
+            else if (done == flush_batch)
+                break;
+            else if (now - pc->last_write >= flush_idle_time * 10000ull)
+                reasons[num] = &flush_stats.idle;
+            else if (now - pc->first_write >= flush_max_age * 10000ull)
+                reasons[num] = &flush_stats.aged;
+            else
+                continue;
+
+            InterlockedIncrement(&pc->refcount);
+            pcs[num] = pc;
+            num++;
+            selected += pc->alloc_size;
+
+            if (!dirty)
+                done++;
+        }
+
+        flush_stats.passes++;
+
+        KeReleaseSpinLock(&partial_chunks_lock, irql);
+
+        if (num == 0)
+            break;
+
+        num = lock_for_flush(pcs, num, false, reasons);
+
+        // anything left is busy, so will be written to again soon anyway
+        if (num == 0)
+            break;
+
+        for (uint32_t i = 0; i < num; i++) {
+            InterlockedIncrement64(reasons[i]);
+        }
+
+        flush_partial_chunks(pcs, num);
+
+        flushed = true;
+    }
+
+    if (flushed) {
+        TRACE("passes %llu, full %llu, idle %llu, aged %llu, dirty %llu, evicted %llu, busy %llu, dropped %llu, gathered %llu, gather_expired %llu\n",
+              flush_stats.passes, flush_stats.full, flush_stats.idle, flush_stats.aged, flush_stats.dirty, flush_stats.evicted,
+              flush_stats.busy, flush_stats.dropped, flush_stats.gathered, flush_stats.gather_expired);
+    }
+}
+
+void set_pdo::put_partial_chunk(partial_chunk* pc) {
+    if (InterlockedDecrement(&pc->refcount) == 0) {
+        ExDeleteResourceLite(&pc->lock);
+        ExFreePool(pc);
+    }
+}
+
+// Takes pc out of the hash table and the LRU list, and drops the cache's reference to it.
+// Callers need to hold pc->lock exclusively, and a reference of their own.
+void set_pdo::remove_partial_chunk(partial_chunk* pc) {
+    auto bucket = find_bucket(pc->offset);
+    KIRQL irql;
+
+    KeAcquireSpinLock(&bucket->lock, &irql);
+    RemoveEntryList(&pc->hash_entry);
+    KeReleaseSpinLock(&bucket->lock, irql);
+
+    KeAcquireSpinLock(&partial_chunks_lock, &irql);
+    RemoveEntryList(&pc->list_entry);
+    partial_chunks_size -= pc->alloc_size;
+    KeReleaseSpinLock(&partial_chunks_lock, irql);
+
+    pc->dead = true;
+
+    put_partial_chunk(pc);
+}
+
+// Flushes the least recently used partial chunks until we're back within our budget - or a
+// quarter of it, if the system is running short of nonpaged pool.
+void set_pdo::trim_partial_chunks(partial_chunk* keep) {
+    uint64_t budget = (uint64_t)stripe_cache_size * 1048576;
+    uint32_t group = max(min(flush_stripes, MAX_FLUSH_STRIPES), 1);
+
+    if (low_memory_event && KeReadStateEvent(low_memory_event))
+        budget /= 4;
+
+    while (true) {
+        partial_chunk* pcs[MAX_FLUSH_STRIPES];
+        uint32_t num = 0;
+        uint64_t selected = 0;
+        KIRQL irql;
+
+        // partial_chunks_size is 64-bit, so on x86 we can't read it without the lock
+        KeAcquireSpinLock(&partial_chunks_lock, &irql);
+
+        LIST_ENTRY* le = partial_chunks.Flink;
+        while (le != &partial_chunks && num < group && partial_chunks_size - selected > budget) {
+            auto pc = CONTAINING_RECORD(le, partial_chunk, list_entry);
+
+            le = le->Flink;
+
+            if (pc == keep)
+                continue;
+
+            InterlockedIncrement(&pc->refcount);
+            pcs[num] = pc;
+            num++;
+            selected += pc->alloc_size;
+        }
+
+        KeReleaseSpinLock(&partial_chunks_lock, irql);
+
+        if (num == 0)
+            break;
+
+        num = lock_for_flush(pcs, num, false);
+
+        // everything's busy, so leave it to whoever's using them
+        if (num == 0)
+            break;
+
+        InterlockedExchangeAdd64(&flush_stats.evicted, num);
+
+        flush_partial_chunks(pcs, num);
+    }
+}
+
+void set_pdo::flush_thread() {
+    LARGE_INTEGER due_time;
+    void* objs[] = { &flush_thread_timer, &flush_thread_wake, &gather_timer };
+
+    ObReferenceObject(pdo);
+
+    KeInitializeTimer(&flush_thread_timer);
+
+    due_time.QuadPart = flush_interval * -10000ll;
+
+    KeSetTimer(&flush_thread_timer, due_time, nullptr);
+
+    while (true) {
+        NTSTATUS Status = KeWaitForMultipleObjects(3, objs, WaitAny, Executive, KernelMode, false, nullptr, nullptr);
+
+        // Gathered writes already hold a reference each, which child_removed is waiting for, so
+        // these need sending on - or failing - even if the set's no longer loaded.
+        flush_gathers(readonly);
+
+        if (loaded && Status != STATUS_WAIT_0 + 2 && ExAcquireRundownProtection(&io_rundown)) {
+            flush_idle_chunks();
+            ExReleaseRundownProtection(&io_rundown);
+        }
+
+        // only once per interval, and on the way out
+        if (Status == STATUS_WAIT_0 || readonly)
+            save_flush_stats();
+
+        if (readonly)
+            break;
+
+        if (Status == STATUS_WAIT_0)
+            KeSetTimer(&flush_thread_timer, due_time, nullptr);
+    }
+
+    ObDereferenceObject(pdo);
+    KeCancelTimer(&flush_thread_timer);
+    KeCancelTimer(&gather_timer);
+
+    KeSetEvent(&flush_thread_finished, 0, false);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void flush_thread(void* context) {
+    auto sd = (set_pdo*)context;
+
+    sd->flush_thread();
+}
+
+// Partial chunks are hashed on their stripe number, so that consecutive stripes
+// go in consecutive buckets.
+partial_chunk_bucket* set_pdo::find_bucket(uint64_t chunk_offset) {
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t full_chunk = array_info.chunksize * 512 * data_disks;
+
+    return &partial_chunk_hash[(chunk_offset / full_chunk) % PARTIAL_CHUNK_BUCKETS];
+}
+
+// Callers need to hold bucket->lock.
+static partial_chunk* find_in_bucket(partial_chunk_bucket* bucket, uint64_t chunk_offset) {
+    LIST_ENTRY* le = bucket->list.Flink;
+    while (le != &bucket->list) {
+        auto pc = CONTAINING_RECORD(le, partial_chunk, hash_entry);
+
+        if (pc->offset == chunk_offset)
+            return pc;
+
+        le = le->Flink;
+    }
+
+    return nullptr;
+}
+
+// Returns the partial chunk for a stripe with a reference taken, which the caller needs to
+// drop with put_partial_chunk. The chunk may have been flushed by the time the caller gets
+// its lock, in which case dead will be set.
+partial_chunk* set_pdo::find_partial_chunk(uint64_t chunk_offset) {
+    auto bucket = find_bucket(chunk_offset);
+    KIRQL irql;
+
+    KeAcquireSpinLock(&bucket->lock, &irql);
+
+    auto pc = find_in_bucket(bucket, chunk_offset);
+
+    if (pc)
+        InterlockedIncrement(&pc->refcount);
+
+    KeReleaseSpinLock(&bucket->lock, irql);
+
+    return pc;
+}
+
+// Partial chunks hold the latest data for the sectors they cover, so if a read falls
+// entirely within those we can copy it rather than going to the disks. Otherwise the read
+// goes to the disks as normal - but as they don't have what's in the cache yet, anything
+// there which the read covers gets flushed first.
+bool set_pdo::read_partial_chunks(PIRP Irp, uint64_t offset, uint32_t length) {
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t full_chunk = array_info.chunksize * 512 * data_disks;
+
+    if (IsListEmpty(&partial_chunks))
+        return false;
+
+    auto buf = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+    if (buf) {
+        bool cached = true;
+
+        // if we bail out part of the way through, the read from disk will overwrite what we've copied
+        for (uint64_t pos = offset; pos < offset + length; ) {
+            uint64_t chunk_offset = pos - (pos % full_chunk);
+            uint32_t len = (uint32_t)min(offset + length - pos, chunk_offset + full_chunk - pos);
+
+            auto pc = find_partial_chunk(chunk_offset);
+            if (!pc) {
+                cached = false;
+                break;
+            }
+
+            {
+                shared_eresource l(&pc->lock);
+
+                ULONG first = (ULONG)((pos - chunk_offset) / pc_block);
+                ULONG last = (ULONG)((pos - chunk_offset + len - 1) / pc_block);
+
+                cached = !pc->dead && RtlAreBitsClear(&pc->bmp, first, last - first + 1);
+
+                if (cached)
+                    RtlCopyMemory(buf + pos - offset, pc->data + pos - chunk_offset, len);
+            }
+
+            put_partial_chunk(pc);
+
+            if (!cached)
+                break;
+
+            pos += len;
+        }
+
+        if (cached)
+            return true;
+    }
+
+    for (uint64_t pos = offset; pos < offset + length; ) {
+        uint64_t chunk_offset = pos - (pos % full_chunk);
+        uint32_t len = (uint32_t)min(offset + length - pos, chunk_offset + full_chunk - pos);
+        ULONG first = (ULONG)((pos - chunk_offset) / pc_block);
+        ULONG last = (ULONG)((pos - chunk_offset + len - 1) / pc_block);
+        bool dirty;
+
+        pos += len;
+
+        auto pc = find_partial_chunk(chunk_offset);
+        if (!pc)
+            continue;
+
+        {
+            shared_eresource l(&pc->lock);
+
+            dirty = !pc->dead && !RtlAreBitsSet(&pc->bmp, first, last - first + 1);
+        }
+
+        if (!dirty)
+            put_partial_chunk(pc);
+        else if (lock_for_flush(&pc, 1, true) == 1) // takes over our reference
+            flush_partial_chunks(&pc, 1);
+    }
+
+    return false;
+}
+
+// Keeps anything else which takes a stripe lock away from the stripes between offset and
+// offset + length, until unlock_stripes is called. Flushes hold it from reading the old
+// data or parity until they've written the new parity, and full-stripe writes until they've
+// finished, so that neither sees the other half-done. Anyone who also wants a partial chunk's
+// lock needs to take that first. There's only ever a few of these, so a list will do.
+void set_pdo::lock_stripes(stripe_lock* sl, uint64_t offset, uint64_t length) {
+    KIRQL irql;
+
+    sl->offset = offset;
+    sl->length = length;
+
+    while (true) {
+        bool busy = false;
+
+        KeAcquireSpinLock(&stripe_locks_lock, &irql);
+
+        LIST_ENTRY* le = stripe_locks.Flink;
+        while (le != &stripe_locks) {
+            auto sl2 = CONTAINING_RECORD(le, stripe_lock, list_entry);
+
+            if (sl2->offset < offset + length && offset < sl2->offset + sl2->length) {
+                busy = true;
+                break;
+            }
+
+            le = le->Flink;
+        }
+
+        if (!busy) {
+            InsertTailList(&stripe_locks, &sl->list_entry);
+            KeReleaseSpinLock(&stripe_locks_lock, irql);
+            return;
+        }
+
+        // unlock_stripes sets this with the spinlock held, so we can't miss it
+        KeClearEvent(&stripe_unlocked);
+
+        KeReleaseSpinLock(&stripe_locks_lock, irql);
+
+        KeWaitForSingleObject(&stripe_unlocked, Executive, KernelMode, false, nullptr);
+    }
+}
+
+// Can be called at DISPATCH_LEVEL, from a completion routine.
+void set_pdo::unlock_stripes(stripe_lock* sl) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&stripe_locks_lock, &irql);
+    RemoveEntryList(&sl->list_entry);
+    KeSetEvent(&stripe_unlocked, IO_NO_INCREMENT, false);
+    KeReleaseSpinLock(&stripe_locks_lock, irql);
+}
+
+// A full-stripe write replaces everything a partial chunk for the same stripe holds,
+// including the parity it's waiting to write, so rather than flush it we throw it away.
+void set_pdo::drop_partial_chunks(uint64_t offset, uint64_t length) {
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t full_chunk = array_info.chunksize * 512 * data_disks;
+
+    if (IsListEmpty(&partial_chunks))
+        return;
+
+    for (uint64_t chunk_offset = offset; chunk_offset < offset + length; chunk_offset += full_chunk) {
+        auto pc = find_partial_chunk(chunk_offset);
+        if (!pc)
+            continue;
+
+        ExAcquireResourceExclusiveLite(&pc->lock, true);
+
+        if (!pc->dead) {
+            remove_partial_chunk(pc);
+            InterlockedIncrement64(&flush_stats.dropped);
+        }
+
+        ExReleaseResourceLite(&pc->lock);
+        put_partial_chunk(pc);
+    }
+}
+
+// If the write only covers part of a block we haven't seen before, we need the rest of it
+// from the disk first. Callers need to hold pc->lock exclusively.
+NTSTATUS set_pdo::write_partial_chunk(partial_chunk* pc, uint32_t offset, uint32_t length, void* data) {
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t start = offset - (offset % pc_block), end = sector_align(offset + length, pc_block);
+    bool head = offset != start && RtlCheckBit(&pc->bmp, start / pc_block);
+    bool tail = offset + length != end && RtlCheckBit(&pc->bmp, (end / pc_block) - 1);
+
+    if (head || tail) {
+        NTSTATUS Status = STATUS_SUCCESS;
+        stripe_lock sl;
+
+        // so that we don't read a block while a full-stripe write is halfway through it
+        lock_stripes(&sl, pc->offset, array_info.chunksize * 512 * data_disks);
+
+        if (head)
+            Status = read_old_data(pc, start, pc_block, pc->data);
+
+        if (NT_SUCCESS(Status) && tail && (!head || end - start > pc_block))
+            Status = read_old_data(pc, end - pc_block, pc_block, pc->data);
+
+        unlock_stripes(&sl);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_old_data returned %08x\n", Status);
+            return Status;
+        }
+    }
+
+    RtlCopyMemory(pc->data + offset, data, length);
+
+    RtlClearBits(&pc->bmp, start / pc_block, (end - start) / pc_block);
+
+    return STATUS_SUCCESS;
+}
+
+// Each partial chunk has its own lock, which is held while it's being written to or flushed,
+// so writes to the same stripe are serialized but writes to different stripes aren't. The hash
+// buckets and LRU list have spinlocks, which are only held while they're being changed.
+// If write_back isn't set, the caller is writing the data to disk itself, and only the parity
+// is left for the flush.
+NTSTATUS set_pdo::add_partial_chunk(uint64_t offset, uint32_t length, void* data, bool write_back) {
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t full_chunk = array_info.chunksize * 512 * data_disks;
+    KIRQL irql;
+
+    uint64_t chunk_offset = offset - (offset % full_chunk);
+
+    while (true) {
+        auto pc = find_partial_chunk(chunk_offset);
 
-    if (!pdo)
-        return STATUS_INVALID_DEVICE_REQUEST;
+        if (pc) {
+            NTSTATUS Status = STATUS_SUCCESS;
 
-    if (!pdo->loaded)
-        return STATUS_DEVICE_NOT_READY;
+            ExAcquireResourceExclusiveLite(&pc->lock, true);
 
-    auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
+            // flushed while we were waiting for it
+            if (pc->dead) {
+                ExReleaseResourceLite(&pc->lock);
+                put_partial_chunk(pc);
+                continue;
+            }
 
-    if (IrpSp->Parameters.Read.ByteOffset.QuadPart < 0) {
-        WARN("read start is negative\n");
-        return STATUS_INVALID_PARAMETER;
-    }
+            // move to the end of the LRU list
+            KeAcquireSpinLock(&partial_chunks_lock, &irql);
+            RemoveEntryList(&pc->list_entry);
+            InsertTailList(&partial_chunks, &pc->list_entry);
+            pc->last_write = KeQueryInterruptTime();
+            KeReleaseSpinLock(&partial_chunks_lock, irql);
 
-    if ((uint64_t)IrpSp->Parameters.Read.ByteOffset.QuadPart >= pdo->array_size) {
-        WARN("trying to read past end of device\n");
-        return STATUS_INVALID_PARAMETER;
-    }
+            Status = write_partial_chunk(pc, (uint32_t)(offset - chunk_offset), length, data);
 
-    if ((uint64_t)IrpSp->Parameters.Read.ByteOffset.QuadPart + IrpSp->Parameters.Read.Length > pdo->array_size)
-        IrpSp->Parameters.Read.Length = (ULONG)(pdo->array_size - IrpSp->Parameters.Read.ByteOffset.QuadPart);
+            if (!write_back)
+                pc->written_through = true;
 
-    if (IrpSp->Parameters.Read.ByteOffset.QuadPart % devobj->SectorSize || IrpSp->Parameters.Read.Length % devobj->SectorSize)
-        return STATUS_INVALID_PARAMETER;
+            if (NT_SUCCESS(Status) && RtlAreBitsClear(&pc->bmp, 0, pc_rows * data_disks)) {
+                Status = flush_partial_chunk(pc);
 
-    Irp->IoStatus.Information = IrpSp->Parameters.Read.Length;
+                if (NT_SUCCESS(Status)) {
+                    remove_partial_chunk(pc);
+                    InterlockedIncrement64(&flush_stats.full);
+                } else
+                    ERR("flush_partial_chunk returned %08x\n", Status);
+            }
 
-    if (IrpSp->Parameters.Read.Length == 0)
-        return STATUS_SUCCESS;
+            ExReleaseResourceLite(&pc->lock);
+            put_partial_chunk(pc);
 
-    switch (pdo->array_info.level) {
-        case RAID_LEVEL_0:
-            return pdo->read_raid0(Irp, no_complete);
+            return Status;
+        }
 
-        case RAID_LEVEL_1:
-            return pdo->read_raid1(Irp, no_complete);
+        uint32_t pclen = offsetof(partial_chunk, data[0]);
 
-        case RAID_LEVEL_4:
-        case RAID_LEVEL_5:
-            return pdo->read_raid45(Irp, no_complete);
+        pclen += full_chunk; // data length
+        pclen += sector_align(pc_rows * data_disks, 32) / 8; // bitmap length
 
-        case RAID_LEVEL_6:
-            return pdo->read_raid6(Irp, no_complete);
+        pc = (partial_chunk*)ExAllocatePoolWithTag(NonPagedPool/*FIXME - ?*/, pclen, ALLOC_TAG);
+        if (!pc) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
 
-        case RAID_LEVEL_10:
-            return pdo->read_raid10(Irp, no_complete);
+        pc->offset = chunk_offset;
+        pc->alloc_size = pclen;
+        pc->first_write = pc->last_write = KeQueryInterruptTime();
+        pc->refcount = 2; // one for the cache, one for us
+        pc->dead = false;
+        pc->written_through = !write_back;
 
-        case RAID_LEVEL_LINEAR:
-            return pdo->read_linear(Irp, no_complete);
+        RtlInitializeBitMap(&pc->bmp, (ULONG*)(pc->data + full_chunk), pc_rows * data_disks);
+        RtlSetBits(&pc->bmp, 0, pc_rows * data_disks);
 
-        default:
-            return STATUS_INVALID_DEVICE_REQUEST;
-    }
-}
+        ExInitializeResourceLite(&pc->lock);
+        ExAcquireResourceExclusiveLite(&pc->lock, true);
 
-NTSTATUS device::read(PIRP, bool*) {
-    return STATUS_INVALID_DEVICE_REQUEST;
-}
+        auto bucket = find_bucket(chunk_offset);
 
-NTSTATUS drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
-    NTSTATUS Status;
-    bool top_level;
+        KeAcquireSpinLock(&bucket->lock, &irql);
 
-    FsRtlEnterFileSystem();
+        // another thread got in first
+        if (find_in_bucket(bucket, chunk_offset)) {
+            KeReleaseSpinLock(&bucket->lock, irql);
 
-    top_level = is_top_level(Irp);
+            ExReleaseResourceLite(&pc->lock);
+            ExDeleteResourceLite(&pc->lock);
+            ExFreePool(pc);
 
-    auto dev = (device*)DeviceObject->DeviceExtension;
+            continue;
+        }
 
-    bool no_complete = false;
+        InsertHeadList(&bucket->list, &pc->hash_entry);
 
-    Status = dev->read(Irp, &no_complete);
+        KeReleaseSpinLock(&bucket->lock, irql);
 
-    if (!no_complete) {
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    }
+        KeAcquireSpinLock(&partial_chunks_lock, &irql);
+        InsertTailList(&partial_chunks, &pc->list_entry);
+        partial_chunks_size += pclen;
+        uint64_t cache_size = partial_chunks_size;
+        KeReleaseSpinLock(&partial_chunks_lock, irql);
 
-    if (top_level)
-        IoSetTopLevelIrp(nullptr);
+        NTSTATUS Status = write_partial_chunk(pc, (uint32_t)(offset - chunk_offset), length, data);
 
-    FsRtlExitFileSystem();
+        ExReleaseResourceLite(&pc->lock);
 
-    return Status;
+        if (NT_SUCCESS(Status))
+            trim_partial_chunks(pc);
+
+        put_partial_chunk(pc);
+
+        if (cache_size > (uint64_t)stripe_cache_size * 1048576 * flush_dirty_percent / 100)
+            KeSetEvent(&flush_thread_wake, IO_NO_INCREMENT, false);
+
+        return Status;
+    }
 }
 
-NTSTATUS set_pdo::flush_partial_chunk(partial_chunk* pc) {
+// Writes a whole stripe's data, and its parity, from data. The caller needs to have got rid of
+// any partial chunk for the stripe first.
+NTSTATUS set_pdo::write_full_stripe(uint64_t offset, uint8_t* data) {
+    bool raid6 = array_info.level == RAID_LEVEL_6;
+    uint32_t data_disks = array_info.raid_disks - (raid6 ? 2 : 1);
+    uint32_t chunk_size = array_info.chunksize * 512;
+    auto parity = get_parity_volume(offset);
+    klist<io_context> ctxs;
+    parity_batch batch(chunk_size);
     NTSTATUS Status;
 
-    TRACE("(%llx)\n", pc->offset);
+    np_buffer srcs_buf(sizeof(uint8_t*) * data_disks);
+    if (!srcs_buf.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
-    uint32_t chunk_size = array_info.chunksize * 512;
-    bool asymmetric = array_info.layout == RAID_LAYOUT_LEFT_ASYMMETRIC || array_info.layout == RAID_LAYOUT_RIGHT_ASYMMETRIC;
+    auto srcs = (uint8_t**)srcs_buf.buf;
 
-    np_buffer valid(sector_align(array_info.chunksize, 32) / 8);
-    if (!valid.buf) {
+    auto p = pool.get_parity(chunk_size);
+    if (!p) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RTL_BITMAP valid_bmp;
+    uint8_t* q = nullptr;
+
+    if (raid6) {
+        q = pool.get_parity(chunk_size);
+        if (!q) {
+            ERR("out of memory\n");
+            pool.put_parity(p, chunk_size);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        get_syndrome_order(parity, data, chunk_size, srcs);
+    } else {
+        for (uint32_t i = 0; i < data_disks; i++) {
+            srcs[i] = data + (i * chunk_size);
+        }
+    }
+
+    batch.add(data_disks, 0, chunk_size, srcs, p, q);
+    batch.run();
+
+    for (uint32_t i = 0; i < data_disks + (raid6 ? 2 : 1); i++) {
+        set_child* sc;
+        uint8_t* va;
+
+        if (i < data_disks) {
+            sc = child_list[get_physical_stripe(i, parity)];
+            va = data + (i * chunk_size);
+        } else if (i == data_disks) {
+            sc = child_list[parity];
+            va = p;
+        } else {
+            sc = child_list[(parity + 1) % array_info.raid_disks];
+            va = q;
+        }
+
+        uint64_t stripe_start = (offset / data_disks) + (sc->disk_info.data_offset * 512);
 
-    RtlInitializeBitMap(&valid_bmp, (ULONG*)valid.buf, array_info.chunksize);
+        Status = ctxs.emplace_back_np(sc, stripe_start, stripe_start + chunk_size, &pool);
+        if (!NT_SUCCESS(Status) || !NT_SUCCESS(ctxs.back().Status)) {
+            if (NT_SUCCESS(Status))
+                Status = ctxs.back().Status;
 
-    // FIXME - what if array_info.chunksize not multiple of 8?
-    RtlCopyMemory(valid.buf, pc->bmp.Buffer, array_info.chunksize / 8);
+            ERR("io_context constructor returned %08x\n", Status);
+            goto end;
+        }
 
-    for (uint32_t i = 1; i < data_disks; i++) {
-        do_and(valid.buf, (uint8_t*)pc->bmp.Buffer + (i * array_info.chunksize / 8), array_info.chunksize / 8);
+        ctxs.back().va2 = va;
     }
 
-    {
-        klist<io_context> ctxs;
+    Status = sync_io(ctxs, true);
+    if (!NT_SUCCESS(Status))
+        ERR("writing returned %08x\n", Status);
 
-        auto parity = get_parity_volume(pc->offset);
-        uint32_t stripe = get_physical_stripe(0, parity);
+end:
+    pool.put_parity(p, chunk_size);
 
-        for (uint32_t i = 0; i < data_disks; i++) {
-            ULONG index;
-            io_context* last = nullptr;
-            auto runlength = RtlFindFirstRunClear(&valid_bmp, &index);
+    if (q)
+        pool.put_parity(q, chunk_size);
 
-            while (runlength != 0) {
-                for (uint32_t j = index; j < index + runlength; j++) {
-                    if (RtlCheckBit(&pc->bmp, (i * array_info.chunksize) + j)) {
-                        uint64_t stripe_start = (pc->offset / data_disks) + (j * 512) + (child_list[stripe]->disk_info.data_offset * 512);
+    return Status;
+}
 
-                        if (last && last->stripe_end == stripe_start)
-                            last->stripe_end += 512;
-                        else {
-                            ctxs.emplace_back_np(child_list[stripe], stripe_start, stripe_start + 512);
-                            last = &ctxs.back();
+// Gathered writes are either all written at once, if between them they cover the whole
+// stripe, or sent down the normal write path one by one, in the order they arrived. If a
+// member has gone since they were queued, they're failed.
+void set_pdo::finish_gather(write_gather* g, bool full) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    bool failed = !loaded;
 
-                            if (!NT_SUCCESS(last->Status)) {
-                                ERR("io_context constructor returned %08x\n", last->Status);
-                                return last->Status;
-                            }
+    if (failed)
+        Status = STATUS_DEVICE_NOT_READY;
+    else if (full) {
+        uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+        stripe_lock sl;
 
-                            last->va2 = pc->data + (i * chunk_size) + (j * 512);
-                        }
-                    }
-                }
+        drop_partial_chunks(g->offset, array_info.chunksize * 512 * data_disks);
 
-                runlength = RtlFindNextForwardRunClear(&valid_bmp, index + runlength, &index);
-            }
+        lock_stripes(&sl, g->offset, array_info.chunksize * 512 * data_disks);
 
-            if (asymmetric) {
-                stripe++;
+        Status = write_full_stripe(g->offset, g->data);
 
-                if (stripe == parity) {
-                    if (array_info.level == RAID_LEVEL_6)
-                        stripe += 2;
-                    else
-                        stripe++;
-                }
-            } else
-                stripe = (stripe + 1) % array_info.raid_disks;
+        unlock_stripes(&sl);
+
+        if (NT_SUCCESS(Status))
+            InterlockedIncrement64(&flush_stats.gathered);
+        else {
+            ERR("write_full_stripe returned %08x\n", Status);
+            full = false;
         }
+    }
 
-        if (!ctxs.empty()) {
-            LIST_ENTRY* le = ctxs.list.Flink;
-            while (le != &ctxs.list) {
-                auto& ctx = ctxs.entry(le);
+    if (!full && !failed)
+        InterlockedIncrement64(&flush_stats.gather_expired);
 
-                auto IrpSp = IoGetNextIrpStackLocation(ctx.Irp);
-                IrpSp->MajorFunction = IRP_MJ_READ;
+    while (!IsListEmpty(&g->irps)) {
+        auto Irp = CONTAINING_RECORD(RemoveHeadList(&g->irps), IRP, Tail.Overlay.ListEntry);
+        bool no_complete = false;
 
-                ctx.mdl = IoAllocateMdl(ctx.va2, (ULONG)(ctx.stripe_end - ctx.stripe_start), false, false, nullptr);
-                if (!ctx.mdl) {
-                    ERR("IoAllocateMdl failed\n");
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
+        if (!full && !failed) {
+            if (array_info.level == RAID_LEVEL_6)
+                Status = write_raid6(Irp, &no_complete);
+            else
+                Status = write_raid45(Irp, &no_complete);
+        }
 
-                MmBuildMdlForNonPagedPool(ctx.mdl);
+        if (!no_complete) {
+            Irp->IoStatus.Status = Status;
+            InterlockedDecrement(&writes_in_flight);
+            ExReleaseRundownProtection(&io_rundown);
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        }
+    }
 
-                ctx.Irp->MdlAddress = ctx.mdl;
+    ExFreePool(g);
+}
 
-                IrpSp->FileObject = ctx.sc->fileobj;
-                IrpSp->Parameters.Read.ByteOffset.QuadPart = ctx.stripe_start;
-                IrpSp->Parameters.Read.Length = (ULONG)(ctx.stripe_end - ctx.stripe_start);
+// Takes a gather off gathers, so that nothing else gets added to it, and queues it for the
+// flush thread once any writes still copying into it have finished. Callers need to hold
+// gather_lock.
+void set_pdo::close_gather(write_gather* g, bool full) {
+    RemoveEntryList(&g->list_entry);
+    num_gathers--;
 
-                ctx.Status = IoCallDriver(ctx.sc->device, ctx.Irp);
+    g->full = full;
 
-                le = le->Flink;
-            }
+    if (g->copying == 0)
+        InsertTailList(&ready_gathers, &g->list_entry);
+    else
+        g->closed = true;
+}
 
-            Status = STATUS_SUCCESS;
+// Called by the flush thread - sends on the gathers which are full or have been waiting
+// longer than write_gather_time, or all of them if all is set.
+void set_pdo::flush_gathers(bool all) {
+    LIST_ENTRY ready;
+    uint64_t now = KeQueryInterruptTime();
+    KIRQL irql;
 
-            le = ctxs.list.Flink;
-            while (le != &ctxs.list) {
-                auto& ctx = ctxs.entry(le);
+    InitializeListHead(&ready);
 
-                if (ctx.Status == STATUS_PENDING) {
-                    KeWaitForSingleObject(&ctx.Event, Executive, KernelMode, false, nullptr);
-                    ctx.Status = ctx.iosb.Status;
-                }
+    KeAcquireSpinLock(&gather_lock, &irql);
 
-                if (!NT_SUCCESS(ctx.Status)) {
-                    ERR("reading returned %08x\n", ctx.Status);
-                    Status = ctx.Status;
-                }
+    while (!IsListEmpty(&gathers)) {
+        auto g = CONTAINING_RECORD(gathers.Flink, write_gather, list_entry);
 
-                le = le->Flink;
-            }
+        if (!all && g->deadline > now) {
+            LARGE_INTEGER due_time;
 
-            if (!NT_SUCCESS(Status))
-                return Status;
+            due_time.QuadPart = -(int64_t)(g->deadline - now);
+            KeSetTimer(&gather_timer, due_time, nullptr);
+            break;
         }
+
+        close_gather(g, false);
     }
 
-    if (array_info.level == RAID_LEVEL_6)
-        return flush_partial_chunk_raid6(pc, &valid_bmp);
-    else
-        return flush_partial_chunk_raid45(pc, &valid_bmp);
-}
+    while (!IsListEmpty(&ready_gathers)) {
+        InsertTailList(&ready, RemoveHeadList(&ready_gathers));
+    }
 
-void set_pdo::flush_chunks() {
-    exclusive_eresource l(&partial_chunks_lock);
+    KeReleaseSpinLock(&gather_lock, irql);
 
-    while (!IsListEmpty(&partial_chunks)) {
-        auto pc = CONTAINING_RECORD(RemoveHeadList(&partial_chunks), partial_chunk, list_entry);
+    if (IsListEmpty(&ready))
+        return;
 
-        flush_partial_chunk(pc);
+    // When all is set, whoever's stopping us holds the lock exclusively until we're done.
+    if (!all)
+        ExAcquireResourceSharedLite(&lock, true);
 
-        ExFreePool(pc);
+    while (!IsListEmpty(&ready)) {
+        auto g = CONTAINING_RECORD(RemoveHeadList(&ready), write_gather, list_entry);
+
+        finish_gather(g, g->full);
     }
+
+    if (!all)
+        ExReleaseResourceLite(&lock);
 }
 
-void set_pdo::flush_thread() {
-    LARGE_INTEGER due_time;
+// When a stream of small sequential writes is queued up, we hold on to them for up to
+// write_gather_time, in case between them they fill a whole stripe - in which case it can
+// be written in one go along with its parity, rather than piece by piece through the stripe
+// cache. We only start doing this if other writes are in flight, so that a writer waiting
+// for each write to finish before sending the next one isn't held up.
+bool set_pdo::gather_write(PIRP Irp) {
+    auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart;
+    uint32_t length = IrpSp->Parameters.Write.Length;
+    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
+    uint32_t full_chunk = array_info.chunksize * 512 * data_disks;
+    bool sequential = (uint64_t)InterlockedExchange64(&last_write_end, offset + length) == offset;
+    write_gather* g = nullptr;
+    KIRQL irql;
 
-    ObReferenceObject(pdo);
+    if (write_gather_time == 0 || array_info.chunksize == 0 || (offset % 512) != 0 || (length % 512) != 0)
+        return false;
 
-    KeInitializeTimer(&flush_thread_timer);
+    uint64_t chunk_offset = offset - (offset % full_chunk);
 
-    due_time.QuadPart = flush_interval * -10000000ll;
+    if (length >= full_chunk || offset + length > chunk_offset + full_chunk)
+        return false;
 
-    KeSetTimer(&flush_thread_timer, due_time, nullptr);
+    // we copy the data straight away, but can't if the pages aren't locked
+    if (!Irp->MdlAddress || !(Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL | MDL_SOURCE_IS_NONPAGED_POOL)))
+        return false;
 
-    while (true) {
-        KeWaitForSingleObject(&flush_thread_timer, Executive, KernelMode, false, nullptr);
+    auto data = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (!data)
+        return false;
 
-        if (loaded)
-            flush_chunks();
+    KeAcquireSpinLock(&gather_lock, &irql);
 
-        if (readonly)
+    LIST_ENTRY* le = gathers.Flink;
+    while (le != &gathers) {
+        auto g2 = CONTAINING_RECORD(le, write_gather, list_entry);
+
+        if (g2->offset == chunk_offset) {
+            g = g2;
             break;
+        }
 
-        KeSetTimer(&flush_thread_timer, due_time, nullptr);
+        le = le->Flink;
     }
 
-    ObDereferenceObject(pdo);
-    KeCancelTimer(&flush_thread_timer);
+    if (!g) {
+        if (!sequential || writes_in_flight <= 1 || num_gathers >= MAX_WRITE_GATHERS) {
+            KeReleaseSpinLock(&gather_lock, irql);
+            return false;
+        }
 
-    KeSetEvent(&flush_thread_finished, 0, false);
+        g = (write_gather*)ExAllocatePoolWithTag(NonPagedPool, offsetof(write_gather, data[0]) + full_chunk +
+                                                 (sector_align(full_chunk / 512, 32) / 8), ALLOC_TAG);
+        if (!g) {
+            KeReleaseSpinLock(&gather_lock, irql);
+            return false;
+        }
 
-    PsTerminateSystemThread(STATUS_SUCCESS);
-}
+        g->offset = chunk_offset;
+        g->deadline = KeQueryInterruptTime() + (write_gather_time * 10000ull);
+        InitializeListHead(&g->irps);
+        g->copying = 0;
+        g->full = false;
+        g->closed = false;
 
-void flush_thread(void* context) {
-    auto sd = (set_pdo*)context;
+        RtlInitializeBitMap(&g->bmp, (ULONG*)(g->data + full_chunk), full_chunk / 512);
+        RtlSetAllBits(&g->bmp);
 
-    sd->flush_thread();
-}
+        if (IsListEmpty(&gathers)) {
+            LARGE_INTEGER due_time;
 
-NTSTATUS set_pdo::add_partial_chunk(uint64_t offset, uint32_t length, void* data) {
-    uint32_t data_disks = array_info.raid_disks - (array_info.level == RAID_LEVEL_6 ? 2 : 1);
-    uint32_t full_chunk = array_info.chunksize * 512 * data_disks;
+            due_time.QuadPart = write_gather_time * -10000ll;
+            KeSetTimer(&gather_timer, due_time, nullptr);
+        }
 
-    uint64_t chunk_offset = offset - (offset % full_chunk);
+        InsertTailList(&gathers, &g->list_entry);
+        num_gathers++;
+    }
 
-    exclusive_eresource l(&partial_chunks_lock);
+    // Only one write gets to copy to each sector, so that we don't have to copy with the
+    // spinlock held. Anything which overlaps an earlier write goes the normal way.
+    if (!RtlAreBitsSet(&g->bmp, (ULONG)((offset - chunk_offset) / 512), length / 512)) {
+        KeReleaseSpinLock(&gather_lock, irql);
+        return false;
+    }
 
-    LIST_ENTRY* le = partial_chunks.Flink;
+    RtlClearBits(&g->bmp, (ULONG)((offset - chunk_offset) / 512), length / 512);
 
-    while (le != &partial_chunks) {
-        auto pc = CONTAINING_RECORD(le, partial_chunk, list_entry);
+    IoMarkIrpPending(Irp);
+    InsertTailList(&g->irps, &Irp->Tail.Overlay.ListEntry);
 
-        if (pc->offset == chunk_offset) {
-            RtlCopyMemory(pc->data + offset - chunk_offset, data, length);
+    g->copying++;
 
-            RtlClearBits(&pc->bmp, (ULONG)((offset - chunk_offset) / 512), length / 512);
+    if (RtlAreBitsClear(&g->bmp, 0, full_chunk / 512))
+        close_gather(g, true);
 
-            if (RtlAreBitsClear(&pc->bmp, 0, array_info.chunksize * data_disks)) {
-                NTSTATUS Status = flush_partial_chunk(pc);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("flush_partial_chunk returned %08x\n", Status);
-                    return Status;
-                }
+    KeReleaseSpinLock(&gather_lock, irql);
 
-                RemoveEntryList(&pc->list_entry);
-                ExFreePool(pc);
-            }
+    RtlCopyMemory(g->data + offset - chunk_offset, data, length);
 
-            return STATUS_SUCCESS;
-        } else if (pc->offset > chunk_offset)
-            break;
+    KeAcquireSpinLock(&gather_lock, &irql);
 
-        le = le->Flink;
+    g->copying--;
+
+    bool ready = g->closed && g->copying == 0;
+
+    if (ready)
+        InsertTailList(&ready_gathers, &g->list_entry);
+
+    KeReleaseSpinLock(&gather_lock, irql);
+
+    // wake the flush thread
+    if (ready) {
+        LARGE_INTEGER due_time;
+
+        due_time.QuadPart = 0;
+        KeSetTimer(&gather_timer, due_time, nullptr);
     }
 
-    uint32_t pclen = offsetof(partial_chunk, data[0]);
+    return true;
+}
 
-    pclen += full_chunk; // data length
-    pclen += sector_align(array_info.chunksize * data_disks, 32) / 8; // bitmap length
+NTSTATUS set_device::write_set(PIRP Irp, bool* no_complete) {
+    auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
-    auto pc = (partial_chunk*)ExAllocatePoolWithTag(NonPagedPool/*FIXME - ?*/, pclen, ALLOC_TAG);
-    if (!pc) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+    switch (pdo->array_info.level) {
+        case RAID_LEVEL_1:
+            return pdo->write_raid1(Irp, no_complete);
+
+        case RAID_LEVEL_LINEAR:
+            return pdo->write_linear(Irp, no_complete);
+
+        case RAID_LEVEL_0:
+        case RAID_LEVEL_4:
+        case RAID_LEVEL_5:
+        case RAID_LEVEL_6:
+        case RAID_LEVEL_10:
+            break;
+
+        default:
+            return STATUS_INVALID_DEVICE_REQUEST;
     }
 
-    pc->offset = chunk_offset;
+    NTSTATUS Status;
 
-    RtlInitializeBitMap(&pc->bmp, (ULONG*)(pc->data + full_chunk), array_info.chunksize * data_disks);
-    RtlSetBits(&pc->bmp, 0, array_info.chunksize * data_disks);
+    InterlockedIncrement(&pdo->writes_in_flight);
 
-    RtlCopyMemory(pc->data + offset - chunk_offset, data, length);
+    if (read_ahead_stripes != 0)
+        pdo->invalidate_read_ahead(IrpSp->Parameters.Write.ByteOffset.QuadPart, IrpSp->Parameters.Write.Length);
 
-    RtlClearBits(&pc->bmp, (ULONG)((offset - chunk_offset) / 512), length / 512);
+    if (pdo->array_info.level == RAID_LEVEL_0)
+        Status = pdo->write_raid0(Irp, no_complete);
+    else if (pdo->array_info.level == RAID_LEVEL_10)
+        Status = pdo->write_raid10(Irp, no_complete);
+    else if (pdo->gather_write(Irp)) {
+        *no_complete = true;
+        return STATUS_PENDING;
+    } else if (pdo->array_info.level == RAID_LEVEL_6)
+        Status = pdo->write_raid6(Irp, no_complete);
+    else
+        Status = pdo->write_raid45(Irp, no_complete);
 
-    InsertHeadList(le->Blink, &pc->list_entry);
+    if (!*no_complete)
+        InterlockedDecrement(&pdo->writes_in_flight);
 
-    return STATUS_SUCCESS;
+    return Status;
 }
 
 NTSTATUS set_device::write(PIRP Irp, bool* no_complete) {
@@ -502,29 +2475,16 @@ NTSTATUS set_device::write(PIRP Irp, bool* no_complete) {
     if (IrpSp->Parameters.Write.Length == 0)
         return STATUS_SUCCESS;
 
-    switch (pdo->array_info.level) {
-        case RAID_LEVEL_0:
-            return pdo->write_raid0(Irp, no_complete);
-
-        case RAID_LEVEL_1:
-            return pdo->write_raid1(Irp);
-
-        case RAID_LEVEL_4:
-        case RAID_LEVEL_5:
-            return pdo->write_raid45(Irp, no_complete);
-
-        case RAID_LEVEL_6:
-            return pdo->write_raid6(Irp, no_complete);
+    // see set_device::read
+    if (!ExAcquireRundownProtection(&pdo->io_rundown))
+        return STATUS_DEVICE_NOT_READY;
 
-        case RAID_LEVEL_10:
-            return pdo->write_raid10(Irp);
+    auto Status = write_set(Irp, no_complete);
 
-        case RAID_LEVEL_LINEAR:
-            return pdo->write_linear(Irp, no_complete);
+    if (!*no_complete)
+        ExReleaseRundownProtection(&pdo->io_rundown);
 
-        default:
-            return STATUS_INVALID_DEVICE_REQUEST;
-    }
+    return Status;
 }
 
 NTSTATUS device::write(PIRP, bool*) {
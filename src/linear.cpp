@@ -17,27 +17,38 @@
 
 #include "winmd.h"
 
-NTSTATUS set_pdo::io_linear2(PIRP Irp, uint64_t offset, uint32_t start_disk, bool write) {
-    NTSTATUS Status;
+NTSTATUS set_pdo::io_linear2(PIRP Irp, uint64_t offset, uint32_t start_disk, bool write, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
     uint32_t length = write ? IrpSp->Parameters.Write.Length : IrpSp->Parameters.Read.Length;
-    klist<io_context> ctxs;
     auto va = (uint8_t*)MmGetMdlVirtualAddress(Irp->MdlAddress);
 
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto& ctxs = parent->ctx_list;
+
     for (uint32_t i = start_disk; i < array_info.raid_disks; i++) {
         auto io_length = (uint32_t)min(length, (child_list[i]->disk_info.data_size * 512) - offset);
 
-        ctxs.emplace_back_np(child_list[i], offset + (child_list[i]->disk_info.data_offset * 512), io_length);
+        ctxs.emplace_back_np(child_list[i], offset + (child_list[i]->disk_info.data_offset * 512), io_length, &pool);
         auto& last = ctxs.back();
 
         if (!NT_SUCCESS(last.Status)) {
             ERR("io_context constructor returned %08x\n", last.Status);
-            return last.Status;
+            NTSTATUS Status = last.Status;
+            delete parent;
+            return Status;
         }
 
         last.mdl = IoAllocateMdl(va, io_length, false, false, nullptr);
         if (!last.mdl) {
             ERR("IoAllocateMdl failed\n");
+            delete parent;
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
@@ -59,8 +70,6 @@ NTSTATUS set_pdo::io_linear2(PIRP Irp, uint64_t offset, uint32_t start_disk, boo
             IrpSp2->Parameters.Read.Length = io_length;
         }
 
-        last.Status = IoCallDriver(last.sc->device, last.Irp);
-
         length -= io_length;
 
         if (length == 0)
@@ -70,26 +79,16 @@ NTSTATUS set_pdo::io_linear2(PIRP Irp, uint64_t offset, uint32_t start_disk, boo
         va += io_length;
     }
 
-    Status = STATUS_SUCCESS;
-
     LIST_ENTRY* le = ctxs.list.Flink;
     while (le != &ctxs.list) {
-        auto& ctx = ctxs.entry(le);
-
-        if (ctx.Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctx.Event, Executive, KernelMode, false, nullptr);
-            ctx.Status = ctx.iosb.Status;
-        }
-
-        if (!NT_SUCCESS(ctx.Status)) {
-            ERR("device returned %08x\n", ctx.Status);
-            Status = ctx.Status;
-        }
+        NTSTATUS Status = parent->call(ctxs.entry(le));
+        if (!NT_SUCCESS(Status))
+            ERR("IoCallDriver returned %08x\n", Status);
 
         le = le->Flink;
     }
 
-    return Status;
+    return parent->pend(no_complete);
 }
 
 NTSTATUS set_pdo::read_linear(PIRP Irp, bool* no_complete) {
@@ -114,11 +113,13 @@ NTSTATUS set_pdo::read_linear(PIRP Irp, bool* no_complete) {
                 if (i == array_info.raid_disks - 1)
                     IrpSp2->Parameters.Read.Length = (uint32_t)min(IrpSp2->Parameters.Read.Length, ((child_list[i]->disk_info.data_size * 512) - offset));
 
+                IoSetCompletionRoutine(Irp, passthrough_completion, this, true, true, true);
+
                 *no_complete = true;
 
                 return IoCallDriver(c->device, Irp);
             } else
-                return io_linear2(Irp, offset, i, false);
+                return io_linear2(Irp, offset, i, false, no_complete);
         }
 
         offset -= child_list[i]->disk_info.data_size * 512;
@@ -147,11 +148,13 @@ NTSTATUS set_pdo::write_linear(PIRP Irp, bool* no_complete) {
                 if (i == array_info.raid_disks - 1)
                     IrpSp2->Parameters.Write.Length = (uint32_t)min(IrpSp2->Parameters.Write.Length, ((child_list[i]->disk_info.data_size * 512) - offset));
 
+                IoSetCompletionRoutine(Irp, passthrough_completion, this, true, true, true);
+
                 *no_complete = true;
 
                 return IoCallDriver(c->device, Irp);
             } else
-                return io_linear2(Irp, offset, i, true);
+                return io_linear2(Irp, offset, i, true, no_complete);
         }
 
         offset -= child_list[i]->disk_info.data_size * 512;
@@ -0,0 +1,231 @@
+/* Copyright (c) Mark Harmstone 2019
+ *
+ * This file is part of WinMD.
+ *
+ * WinMD is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinMD.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "winmd.h"
+
+uint32_t parity_threads = 0;
+
+static worker_pool parity_workers;
+
+static void run_job(worker_job* wj) {
+    auto job = (parity_job*)wj;
+    auto batch = job->batch;
+
+    if (job->q)
+        gen_syndrome(job->num, job->end, job->srcs, job->p, job->q, job->off);
+    else
+        xor_blocks(job->num, job->end, job->srcs, job->p, job->off);
+
+    // batch may be freed as soon as we've signalled it
+    if (InterlockedDecrement(&batch->outstanding) == 0)
+        KeSetEvent(&batch->Event, 0, false);
+}
+
+worker_job* worker_pool::dequeue() {
+    KIRQL irql;
+    worker_job* job = nullptr;
+
+    KeAcquireSpinLock(&lock, &irql);
+
+    if (!IsListEmpty(&jobs))
+        job = CONTAINING_RECORD(RemoveHeadList(&jobs), worker_job, list_entry);
+
+    KeReleaseSpinLock(&lock, irql);
+
+    return job;
+}
+
+void worker_pool::worker(void* context) {
+    auto pool = (worker_pool*)context;
+
+    while (true) {
+        KeWaitForSingleObject(&pool->sem, Executive, KernelMode, false, nullptr);
+
+        if (pool->stopping)
+            break;
+
+        auto job = pool->dequeue();
+
+        // the submitting thread may have got to it first
+        if (job)
+            job->func(job);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void worker_pool::start(uint32_t num) {
+    num = min(num, MAX_WORKER_THREADS);
+
+    KeInitializeSpinLock(&lock);
+    InitializeListHead(&jobs);
+    KeInitializeSemaphore(&sem, 0, MAXLONG);
+
+    for (uint32_t i = 0; i < num; i++) {
+        HANDLE h;
+
+        NTSTATUS Status = PsCreateSystemThread(&h, 0, nullptr, nullptr, nullptr, worker, this);
+        if (!NT_SUCCESS(Status)) {
+            ERR("PsCreateSystemThread returned %08x\n", Status);
+            break;
+        }
+
+        Status = ObReferenceObjectByHandle(h, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (void**)&threads[num_workers], nullptr);
+
+        NtClose(h);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("ObReferenceObjectByHandle returned %08x\n", Status);
+            break;
+        }
+
+        num_workers++;
+    }
+}
+
+void worker_pool::stop() {
+    if (num_workers == 0)
+        return;
+
+    stopping = true;
+
+    KeReleaseSemaphore(&sem, IO_NO_INCREMENT, num_workers, false);
+
+    for (uint32_t i = 0; i < num_workers; i++) {
+        KeWaitForSingleObject(threads[i], Executive, KernelMode, false, nullptr);
+        ObDereferenceObject(threads[i]);
+    }
+
+    num_workers = 0;
+}
+
+// Moves the jobs in list onto the queue, leaving list empty.
+void worker_pool::queue(LIST_ENTRY* list, uint32_t num) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&lock, &irql);
+
+    while (!IsListEmpty(list)) {
+        InsertTailList(&jobs, RemoveHeadList(list));
+    }
+
+    KeReleaseSpinLock(&lock, irql);
+
+    KeReleaseSemaphore(&sem, IO_NO_INCREMENT, (LONG)min(num, num_workers), false);
+}
+
+void start_parity_workers() {
+    uint32_t num = parity_threads;
+
+    if (num == 0)
+        num = KeQueryActiveProcessorCount(nullptr);
+
+    parity_workers.start(num);
+
+    TRACE("started %u parity worker threads\n", parity_workers.num_workers);
+}
+
+void stop_parity_workers() {
+    parity_workers.stop();
+}
+
+// The jobs are allocated in one go, rather than each time add is called. If there's only
+// going to be one, or there aren't any worker threads, we don't bother.
+parity_batch::parity_batch(uint32_t length) {
+    KeInitializeEvent(&Event, NotificationEvent, false);
+
+    if (parity_workers.num_workers == 0 || length <= PARITY_SLICE)
+        return;
+
+    uint32_t num = (length + PARITY_SLICE - 1) / PARITY_SLICE;
+
+    jobs = (parity_job*)ExAllocatePoolWithTag(NonPagedPool, sizeof(parity_job) * num, ALLOC_TAG);
+
+    if (jobs)
+        max_jobs = num;
+}
+
+parity_batch::~parity_batch() {
+    if (jobs)
+        ExFreePool(jobs);
+}
+
+// Jobs get split into slices, so that a single large stripe can be spread over several CPUs.
+// Once we've run out of jobs, we just do the work there and then.
+void parity_batch::add(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* p, uint8_t* q) {
+    while (off < end) {
+        uint32_t slice_end = end - off > PARITY_SLICE ? off + PARITY_SLICE : end;
+
+        if (num_jobs == max_jobs) {
+            if (q)
+                gen_syndrome(num, end, srcs, p, q, off);
+            else
+                xor_blocks(num, end, srcs, p, off);
+
+            return;
+        }
+
+        auto& job = jobs[num_jobs];
+
+        job.batch = this;
+        job.num = num;
+        job.srcs = srcs;
+        job.p = p;
+        job.q = q;
+        job.off = off;
+        job.end = slice_end;
+        num_jobs++;
+
+        off = slice_end;
+    }
+}
+
+void parity_batch::run() {
+    if (num_jobs == 0)
+        return;
+
+    if (num_jobs == 1) {
+        outstanding = 1;
+        run_job(&jobs[0]);
+        return;
+    }
+
+    LIST_ENTRY list;
+
+    InitializeListHead(&list);
+
+    outstanding = num_jobs;
+
+    for (uint32_t i = 0; i < num_jobs; i++) {
+        jobs[i].func = run_job;
+        InsertTailList(&list, &jobs[i].list_entry);
+    }
+
+    parity_workers.queue(&list, num_jobs);
+
+    // rather than sit idle, take jobs off the queue ourselves - these might not be ours
+    while (outstanding > 0) {
+        auto job = parity_workers.dequeue();
+
+        if (!job)
+            break;
+
+        job->func(job);
+    }
+
+    KeWaitForSingleObject(&Event, Executive, KernelMode, false, nullptr);
+}
@@ -21,9 +21,6 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
     uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Read.Length;
-    bool mdl_locked = true;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     if (array_info.chunksize == 0 || (array_info.chunksize * 512) % PAGE_SIZE != 0)
         return STATUS_INTERNAL_ERROR;
@@ -46,6 +43,8 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
 
+        IoSetCompletionRoutine(Irp, passthrough_completion, this, true, true, true);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -64,13 +63,23 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
     get_raid0_offset(offset, stripe_length, array_info.raid_disks, &startoff, &startoffstripe);
     get_raid0_offset(offset + length - 1, stripe_length, array_info.raid_disks, &endoff, &endoffstripe);
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (startoffstripe > i)
@@ -92,7 +101,8 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -128,9 +138,9 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
             ctxs[i].Status = STATUS_SUCCESS;
     }
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -141,27 +151,30 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
+
+        parent->skip_first = skip_first;
+        parent->copy_length = length - skip_first;
     }
 
     {
@@ -174,7 +187,7 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             uint32_t len, pages;
@@ -214,52 +227,16 @@ NTSTATUS set_pdo::read_raid0(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
     }
 
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
-        }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
-    }
-
-    if (tmpbuf) {
-        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
-
-        RtlCopyMemory(dest, tmpbuf + skip_first, length - skip_first);
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].va)
-            ExFreePool(ctxs[i].va);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
@@ -268,9 +245,6 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
     uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Write.Length;
-    bool mdl_locked = true;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
     io_context* ctxs = nullptr;
 
     if (array_info.chunksize == 0 || (array_info.chunksize * 512) % PAGE_SIZE != 0)
@@ -294,6 +268,8 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Write.ByteOffset.QuadPart = start;
 
+        IoSetCompletionRoutine(Irp, write_completion, this, true, true, true);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -305,11 +281,21 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
 
     uint32_t skip_first = offset % PAGE_SIZE ? (PAGE_SIZE - (offset % PAGE_SIZE)) : 0;
     NTSTATUS Status;
-    io_context first_bit;
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->in_flight = &writes_in_flight;
+    parent->rundown = &io_rundown;
+
+    auto& first_bit = parent->first_bit;
 
-    if (!mdl_locked) {
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -320,13 +306,14 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            return Status;
+            parent->mdl_locked = true;
+            goto end;
         }
     }
 
     if (skip_first != 0) {
         first_bit.sc = child_list[start_chunk % array_info.raid_disks];
-        first_bit.Irp = IoAllocateIrp(first_bit.sc->device->StackSize, false);
+        first_bit.Irp = pool.get_irp(first_bit);
 
         if (!first_bit.Irp) {
             ERR("IoAllocateIrp failed\n");
@@ -373,13 +360,15 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
     get_raid0_offset(offset, stripe_length, array_info.raid_disks, &startoff, &startoffstripe);
     get_raid0_offset(offset + length - 1, stripe_length, array_info.raid_disks, &endoff, &endoffstripe);
 
-    ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (startoffstripe > i)
@@ -399,7 +388,8 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -436,25 +426,25 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
 
         auto src = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
-        RtlCopyMemory(tmpbuf, (uint8_t*)src + skip_first, length);
+        RtlCopyMemory(parent->tmpbuf, (uint8_t*)src + skip_first, length);
     }
 
     {
@@ -467,7 +457,7 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             uint32_t len, pages;
@@ -507,62 +497,22 @@ NTSTATUS set_pdo::write_raid0(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
     }
 
     if (skip_first != 0) {
-        first_bit.Status = IoCallDriver(first_bit.sc->device, first_bit.Irp);
-        if (!NT_SUCCESS(first_bit.Status))
-            ERR("IoCallDriver returned %08x\n", first_bit.Status);
+        Status = parent->call(first_bit);
+        if (!NT_SUCCESS(Status))
+            ERR("IoCallDriver returned %08x\n", Status);
     }
 
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
-        }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
-    }
-
-    if (skip_first != 0) {
-        if (first_bit.Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&first_bit.Event, Executive, KernelMode, false, nullptr);
-            first_bit.Status = first_bit.iosb.Status;
-        }
-
-        if (!NT_SUCCESS(first_bit.Status))
-            Status = first_bit.Status;
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].va)
-            ExFreePool(ctxs[i].va);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
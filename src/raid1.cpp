@@ -17,40 +17,263 @@
 
 #include "winmd.h"
 
+#define SEQUENTIAL_SLACK 4 // how much busier than the others a mirror can be before we move a stream off it
+
+bool set_pdo::write_mostly(uint32_t disk) {
+    return child_list[disk]->disk_info.devflags & MD_DEVFLAG_WRITE_MOSTLY;
+}
+
+// A read which carries on from where the last one to a mirror finished stays on that mirror,
+// unless it's got a lot more outstanding than the others. Otherwise we go for the mirror
+// with the fewest reads in flight, and of those the one whose head is nearest. Write-mostly
+// members are only read from if they're all we've got, members which are being much
+// slower than the others are avoided, and faulty members are never read from.
+set_child* set_pdo::choose_mirror(uint64_t offset) {
+    uint32_t start = (uint32_t)InterlockedIncrement(&read_device) % array_info.raid_disks;
+    set_child* best = nullptr;
+    set_child* seq = nullptr;
+    LONG best_load = 0;
+    uint64_t best_dist = 0;
+    uint32_t times[MAX_TIMED_COPIES];
+    uint32_t fastest = 0xffffffff;
+    uint32_t fastest_disk = 0xffffffff;
+
+    bool avoid_write_mostly = false;
+
+    for (uint32_t i = 0; i < array_info.raid_disks; i++) {
+        if (!write_mostly(i)) {
+            avoid_write_mostly = true;
+            break;
+        }
+    }
+
+    // Completions keep changing the times, so we only read them once - otherwise the fastest
+    // member could look slow by the time we compare it with itself.
+    for (uint32_t i = 0; i < min(array_info.raid_disks, MAX_TIMED_COPIES); i++) {
+        times[i] = child_list[i]->service_time();
+
+        if (!child_list[i]->faulty && (!avoid_write_mostly || !write_mostly(i)) && times[i] < fastest) {
+            fastest = times[i];
+            fastest_disk = i;
+        }
+    }
+
+    for (uint32_t i = 0; i < array_info.raid_disks; i++) {
+        uint32_t disk = (start + i) % array_info.raid_disks;
+        auto c = child_list[disk];
+        LONG load = c->reads_in_flight;
+        uint64_t head = (uint64_t)c->head_pos;
+        uint64_t dist = head > offset ? head - offset : offset - head;
+
+        if (c->faulty || (avoid_write_mostly && write_mostly(disk)))
+            continue;
+
+        if (disk < MAX_TIMED_COPIES && disk != fastest_disk && set_child::slow(times[disk], fastest)) {
+            c->passed_over();
+            continue;
+        }
+
+        if (head == offset && !seq)
+            seq = c;
+
+        if (!best || load < best_load || (load == best_load && dist < best_dist)) {
+            best = c;
+            best_load = load;
+            best_dist = dist;
+        }
+    }
+
+    if (seq && seq->reads_in_flight <= best_load + SEQUENTIAL_SLACK)
+        return seq;
+
+    return best ? best : child_list[start];
+}
+
+// Whether a split read should get a piece from disk - never if it's write-mostly or faulty,
+// nor if it's being much slower than the fastest member, as it'd hold up the whole read.
+bool set_pdo::split_member(uint32_t disk, const uint32_t* times, uint32_t fastest_disk) {
+    if (write_mostly(disk) || child_list[disk]->faulty)
+        return false;
+
+    return disk >= MAX_TIMED_COPIES || disk == fastest_disk || !set_child::slow(times[disk], times[fastest_disk]);
+}
+
+// Reads bigger than raid1_split_size get divided into a page-aligned piece for each mirror
+// that split_member picks, so that they're all kept busy.
+NTSTATUS set_pdo::read_raid1_split(PIRP Irp, bool* no_complete, uint32_t readable, const uint32_t* times, uint32_t fastest_disk) {
+    auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
+    uint32_t length = IrpSp->Parameters.Read.Length;
+    uint32_t piece = sector_align(length / readable, (uint32_t)PAGE_SIZE);
+    uint32_t pos = 0;
+    NTSTATUS Status;
+
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+
+    if (!parent->mdl_locked) {
+        Status = STATUS_SUCCESS;
+
+        seh_try {
+            MmProbeAndLockPages(Irp->MdlAddress, KernelMode, IoWriteAccess);
+        } seh_except (EXCEPTION_EXECUTE_HANDLER) {
+            Status = GetExceptionCode();
+        }
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("MmProbeAndLockPages threw exception %08x\n", Status);
+            parent->mdl_locked = true;
+            delete parent;
+            return Status;
+        }
+    }
+
+    auto va = (uint8_t*)MmGetMdlVirtualAddress(Irp->MdlAddress);
+    auto& ctxs = parent->ctx_list;
+
+    for (uint32_t i = 0; i < array_info.raid_disks && pos < length; i++) {
+        auto c = child_list[i];
+
+        if (!split_member(i, times, fastest_disk)) {
+            if (!write_mostly(i) && !c->faulty)
+                c->passed_over();
+
+            continue;
+        }
+
+        uint32_t io_length = min(length - pos, piece);
+        uint64_t start = offset + pos + (c->disk_info.data_offset * 512);
+
+        Status = ctxs.emplace_back_np(c, start, start + io_length, &pool);
+        if (!NT_SUCCESS(Status) || !NT_SUCCESS(ctxs.back().Status)) {
+            if (NT_SUCCESS(Status))
+                Status = ctxs.back().Status;
+
+            ERR("io_context constructor returned %08x\n", Status);
+            delete parent;
+            return Status;
+        }
+
+        auto& last = ctxs.back();
+
+        last.mdl = IoAllocateMdl(va + pos, io_length, false, false, nullptr);
+        if (!last.mdl) {
+            ERR("IoAllocateMdl failed\n");
+            delete parent;
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        last.Irp->MdlAddress = last.mdl;
+
+        IoBuildPartialMdl(Irp->MdlAddress, last.mdl, va + pos, io_length);
+
+        auto IrpSp2 = IoGetNextIrpStackLocation(last.Irp);
+
+        IrpSp2->MajorFunction = IRP_MJ_READ;
+        IrpSp2->FileObject = c->fileobj;
+        IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
+        IrpSp2->Parameters.Read.Length = io_length;
+
+        pos += io_length;
+    }
+
+    LIST_ENTRY* le = ctxs.list.Flink;
+    while (le != &ctxs.list) {
+        auto& ctx = ctxs.entry(le);
+
+        InterlockedExchange64(&ctx.sc->head_pos, ctx.stripe_end - (ctx.sc->disk_info.data_offset * 512));
+        ctx.time_read();
+
+        Status = parent->call(ctx);
+        if (!NT_SUCCESS(Status))
+            ERR("IoCallDriver returned %08x\n", Status);
+
+        le = le->Flink;
+    }
+
+    return parent->pend(no_complete);
+}
+
 NTSTATUS set_pdo::read_raid1(PIRP Irp, bool* no_complete) {
     shared_eresource l(&lock);
 
-    read_device++;
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
+
+    if (raid1_split_size != 0 && IrpSp->Parameters.Read.Length > raid1_split_size) {
+        uint32_t times[MAX_TIMED_COPIES];
+        uint32_t fastest_disk = 0xffffffff;
+        uint32_t readable = 0;
+
+        // As in choose_mirror, the times are only read once.
+        for (uint32_t i = 0; i < min(array_info.raid_disks, MAX_TIMED_COPIES); i++) {
+            times[i] = child_list[i]->service_time();
+
+            if (!write_mostly(i) && !child_list[i]->faulty && (fastest_disk == 0xffffffff || times[i] < times[fastest_disk]))
+                fastest_disk = i;
+        }
+
+        for (uint32_t i = 0; i < array_info.raid_disks; i++) {
+            if (split_member(i, times, fastest_disk))
+                readable++;
+        }
+
+        // If there's only one member worth reading from, we don't split the read.
+        if (readable > 1)
+            return read_raid1_split(Irp, no_complete, readable, times, fastest_disk);
+    }
 
-    auto c = child_list[read_device % array_info.raid_disks];
+    auto c = choose_mirror(offset);
+
+    InterlockedExchange64(&c->head_pos, offset + IrpSp->Parameters.Read.Length);
 
     IoCopyCurrentIrpStackLocationToNext(Irp);
 
-    PIO_STACK_LOCATION IrpSp = IoGetNextIrpStackLocation(Irp);
+    IrpSp = IoGetNextIrpStackLocation(Irp);
 
     IrpSp->FileObject = c->fileobj;
     IrpSp->Parameters.Read.ByteOffset.QuadPart += c->disk_info.data_offset * 512;
 
+    time_read(Irp, c);
+
     *no_complete = true;
 
     return IoCallDriver(c->device, Irp);
 }
 
-NTSTATUS set_pdo::write_raid1(PIRP Irp) {
+NTSTATUS set_pdo::write_raid1(PIRP Irp, bool* no_complete) {
     NTSTATUS Status;
 
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+        ctxs[i].sc = child_list[i];
+        ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
         if (!ctxs[i].Irp) {
             ERR("IoAllocateIrp failed\n");
@@ -75,31 +298,247 @@ NTSTATUS set_pdo::write_raid1(PIRP Irp) {
         IoSetCompletionRoutine(ctxs[i].Irp, io_completion, &ctxs[i], true, true, true);
     }
 
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-        if (!NT_SUCCESS(ctxs[i].Status))
-            ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
+    {
+        bool behind = false;
+
+        if (write_behind_size != 0) {
+            for (unsigned int i = 0; i < array_info.raid_disks; i++) {
+                if (!write_mostly(i)) {
+                    behind = true;
+                    break;
+                }
+            }
+        }
+
+        for (unsigned int i = 0; i < array_info.raid_disks; i++) {
+            if (behind && write_mostly(i)) {
+                Status = queue_write_behind(parent, child_list[i]);
+                if (NT_SUCCESS(Status))
+                    continue;
+
+                ERR("queue_write_behind returned %08x\n", Status);
+            }
+
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
+        }
     }
 
-    Status = STATUS_SUCCESS;
+    return parent->pend(no_complete);
 
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+end:
+    delete parent;
+
+    return Status;
+}
+
+NTSTATUS __stdcall set_pdo::write_behind_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx) {
+    auto wb = (write_behind*)ctx;
+    auto sd = wb->sd;
+
+    // The request has already been completed, so there's no one to tell - the member is now
+    // out of date, and can't be read from until it's been resynced.
+    if (!NT_SUCCESS(Irp->IoStatus.Status) && wb->copied && !wb->sc->faulty) {
+        ERR("write-behind returned %08x, failing member\n", Irp->IoStatus.Status);
+        wb->sc->faulty = true;
+    }
+
+    if (wb->parent)
+        wb->parent->release(Irp->IoStatus.Status);
+
+    sd->finish_write_behind(wb);
+
+    ExReleaseRundownProtection(&sd->io_rundown);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+// Writes to write-mostly members go through a queue, so that they can be allowed to lag
+// behind the others. While there's less than write_behind_size bytes outstanding, we copy the
+// data and let the request complete without waiting for it; otherwise the request waits for
+// the write as before. Either way, overlapping writes to a member are sent in order.
+NTSTATUS set_pdo::queue_write_behind(io_parent* parent, set_child* sc) {
+    auto IrpSp = IoGetCurrentIrpStackLocation(parent->Irp);
+    uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart;
+    uint32_t length = IrpSp->Parameters.Write.Length;
+    NTSTATUS Status;
+    KIRQL irql;
+
+    // a copied write can outlast the request, so needs a reference of its own
+    if (!ExAcquireRundownProtection(&io_rundown))
+        return STATUS_DEVICE_NOT_READY;
+
+    KeAcquireSpinLock(&write_behind_lock, &irql);
+
+    bool copy = write_behind_bytes + length <= write_behind_size;
+
+    if (copy)
+        write_behind_bytes += length;
+
+    KeReleaseSpinLock(&write_behind_lock, irql);
+
+    auto wb = (write_behind*)ExAllocatePoolWithTag(NonPagedPool, offsetof(write_behind, data[0]) + (copy ? length : 0), ALLOC_TAG);
+    if (!wb) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    wb->sd = this;
+    wb->sc = sc;
+    wb->offset = offset;
+    wb->length = length;
+    wb->parent = copy ? nullptr : parent;
+    wb->copied = copy;
+
+    if (copy) {
+        auto src = MmGetSystemAddressForMdlSafe(parent->Irp->MdlAddress, NormalPagePriority);
+        if (!src) {
+            ERR("MmGetSystemAddressForMdlSafe returned NULL\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
 
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
+        RtlCopyMemory(wb->data, src, length);
+    }
+
+    wb->Irp = IoAllocateIrp(sc->device->StackSize, false);
+    if (!wb->Irp) {
+        ERR("IoAllocateIrp failed\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    if (copy) {
+        wb->Irp->MdlAddress = IoAllocateMdl(wb->data, length, false, false, nullptr);
+        if (!wb->Irp->MdlAddress) {
+            ERR("IoAllocateMdl failed\n");
+            IoFreeIrp(wb->Irp);
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        MmBuildMdlForNonPagedPool(wb->Irp->MdlAddress);
+    } else
+        wb->Irp->MdlAddress = parent->Irp->MdlAddress;
+
+    {
+        auto IrpSp2 = IoGetNextIrpStackLocation(wb->Irp);
+
+        IrpSp2->MajorFunction = IRP_MJ_WRITE;
+        IrpSp2->FileObject = sc->fileobj;
+        IrpSp2->Parameters.Write.Length = length;
+        IrpSp2->Parameters.Write.ByteOffset.QuadPart = offset + (sc->disk_info.data_offset * 512);
     }
 
+    IoSetCompletionRoutine(wb->Irp, write_behind_completion, wb, true, true, true);
+
+    if (!copy)
+        InterlockedIncrement(&parent->outstanding);
+
+    KeAcquireSpinLock(&write_behind_lock, &irql);
+
+    InsertTailList(&write_behind_queue, &wb->list_entry);
+
+    if (write_behind_count == 0)
+        KeClearEvent(&write_behind_idle);
+
+    write_behind_count++;
+
+    KeReleaseSpinLock(&write_behind_lock, irql);
+
+    start_write_behinds();
+
+    return STATUS_SUCCESS;
+
 end:
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
+    if (wb)
+        ExFreePool(wb);
+
+    if (copy) {
+        KeAcquireSpinLock(&write_behind_lock, &irql);
+        write_behind_bytes -= length;
+        KeReleaseSpinLock(&write_behind_lock, irql);
     }
 
-    ExFreePool(ctxs);
+    ExReleaseRundownProtection(&io_rundown);
 
     return Status;
 }
+
+static bool write_behinds_overlap(write_behind* wb1, write_behind* wb2) {
+    return wb1->sc == wb2->sc && wb1->offset < wb2->offset + wb2->length && wb2->offset < wb1->offset + wb1->length;
+}
+
+// Sends everything in the queue which doesn't overlap something in flight, or something
+// queued before it.
+void set_pdo::start_write_behinds() {
+    LIST_ENTRY ready;
+    KIRQL irql;
+
+    InitializeListHead(&ready);
+
+    KeAcquireSpinLock(&write_behind_lock, &irql);
+
+    LIST_ENTRY* le = write_behind_queue.Flink;
+    while (le != &write_behind_queue) {
+        auto wb = CONTAINING_RECORD(le, write_behind, list_entry);
+        LIST_ENTRY* le2 = le->Flink;
+        bool blocked = false;
+
+        LIST_ENTRY* le3 = write_behind_active.Flink;
+        while (le3 != &write_behind_active && !blocked) {
+            blocked = write_behinds_overlap(wb, CONTAINING_RECORD(le3, write_behind, list_entry));
+            le3 = le3->Flink;
+        }
+
+        le3 = write_behind_queue.Flink;
+        while (le3 != le && !blocked) {
+            blocked = write_behinds_overlap(wb, CONTAINING_RECORD(le3, write_behind, list_entry));
+            le3 = le3->Flink;
+        }
+
+        if (!blocked) {
+            RemoveEntryList(&wb->list_entry);
+            InsertTailList(&write_behind_active, &wb->list_entry);
+            InsertTailList(&ready, &wb->ready_entry);
+        }
+
+        le = le2;
+    }
+
+    KeReleaseSpinLock(&write_behind_lock, irql);
+
+    while (!IsListEmpty(&ready)) {
+        auto wb = CONTAINING_RECORD(RemoveHeadList(&ready), write_behind, ready_entry);
+
+        IoCallDriver(wb->sc->device, wb->Irp);
+    }
+}
+
+void set_pdo::finish_write_behind(write_behind* wb) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(&write_behind_lock, &irql);
+
+    RemoveEntryList(&wb->list_entry);
+
+    if (wb->copied)
+        write_behind_bytes -= wb->length;
+
+    write_behind_count--;
+
+    if (write_behind_count == 0)
+        KeSetEvent(&write_behind_idle, 0, false);
+
+    KeReleaseSpinLock(&write_behind_lock, irql);
+
+    if (wb->copied)
+        IoFreeMdl(wb->Irp->MdlAddress);
+
+    IoFreeIrp(wb->Irp);
+    ExFreePool(wb);
+
+    start_write_behinds();
+}
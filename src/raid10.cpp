@@ -17,23 +17,84 @@
 
 #include "winmd.h"
 
+// The slowest service time of the disks which a copy is on, or 0xffffffff if any of them are
+// write-mostly.
+uint32_t set_pdo::copy_time(uint64_t base, uint32_t copy, uint64_t step, uint32_t num, set_child** slowest) {
+    uint32_t time = 0;
+
+    for (uint32_t j = 0; j < num; j++) {
+        auto disk = (uint32_t)((base + (j * step) + copy) % array_info.raid_disks);
+
+        if (write_mostly(disk))
+            return 0xffffffff;
+
+        uint32_t t = child_list[disk]->service_time();
+
+        if (j == 0 || t > time) {
+            time = t;
+            *slowest = child_list[disk];
+        }
+    }
+
+    return time;
+}
+
+// Copy n of a chunk is on disk (base + n) % raid_disks - this picks one which isn't on a
+// write-mostly member, or on a member which is being much slower than the others, if it can.
+// If num is more than 1, the same copy has to do for each of base, base + step,
+// base + (2 * step) and so on.
+uint32_t set_pdo::choose_copy(uint64_t base, uint32_t copies, uint64_t step, uint32_t num) {
+    uint32_t start = (uint32_t)read_device % copies;
+    uint32_t times[MAX_TIMED_COPIES];
+    set_child* slowest[MAX_TIMED_COPIES];
+    uint32_t fastest = 0xffffffff;
+    uint32_t fastest_copy = start;
+
+    if (copies > MAX_TIMED_COPIES)
+        return start;
+
+    // as in choose_mirror, each copy's time is only read once
+    for (uint32_t i = 0; i < copies; i++) {
+        times[i] = copy_time(base, i, step, num, &slowest[i]);
+
+        if (times[i] < fastest) {
+            fastest = times[i];
+            fastest_copy = i;
+        }
+    }
+
+    if (fastest == 0xffffffff)
+        return start;
+
+    for (uint32_t i = 0; i < copies; i++) {
+        uint32_t copy = (start + i) % copies;
+
+        if (times[copy] == 0xffffffff)
+            continue;
+
+        if (copy != fastest_copy && set_child::slow(times[copy], fastest)) {
+            slowest[copy]->passed_over();
+            continue;
+        }
+
+        return copy;
+    }
+
+    return fastest_copy;
+}
+
 NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
     uint8_t near = array_info.layout & 0xff;
     uint32_t stripe_length = array_info.chunksize * 512;
     uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Read.Length;
     uint64_t start_chunk = offset / stripe_length;
     uint64_t end_chunk = (offset + length - 1) / stripe_length;
-    void* dummypage = nullptr;
-    PMDL dummy_mdl = nullptr;
     PFN_NUMBER dummy;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     if (start_chunk == end_chunk) { // small reads, on one device
-        uint64_t chunk = (start_chunk * near) + (read_device % near);
+        uint64_t chunk = (start_chunk * near) + choose_copy(start_chunk * near, near);
         auto c = child_list[chunk % array_info.raid_disks];
 
         IoCopyCurrentIrpStackLocationToNext(Irp);
@@ -48,6 +109,8 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
 
+        time_read(Irp, c);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -58,16 +121,29 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
     offset -= skip_first;
     length += skip_first;
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    // the same copy for every chunk, so that each disk's part of the read is contiguous
+    uint32_t copy = choose_copy(start_chunk * near, near, near, (uint32_t)min(end_chunk - start_chunk + 1, array_info.raid_disks));
+
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     {
-        uint64_t chunk = (start_chunk * near) + (read_device % near);
+        uint64_t chunk = (start_chunk * near) + copy;
         uint32_t pos = 0;
 
         while (pos < length) {
@@ -100,28 +176,29 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
     NTSTATUS Status;
 
     {
-        dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-        if (!dummypage) {
+        parent->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+        if (!parent->dummypage) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
-        if (!dummy_mdl) {
+        parent->dummy_mdl = IoAllocateMdl(parent->dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
+        if (!parent->dummy_mdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(dummy_mdl);
+        MmBuildMdlForNonPagedPool(parent->dummy_mdl);
 
-        dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+        dummy = *(PFN_NUMBER*)(parent->dummy_mdl + 1);
     }
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -167,9 +244,9 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
             ctxs[i].Status = STATUS_SUCCESS;
     }
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -180,31 +257,34 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
+
+        parent->skip_first = skip_first;
+        parent->copy_length = length - skip_first;
     }
 
     {
-        uint64_t chunk = (start_chunk * near) + (read_device % near);
+        uint64_t chunk = (start_chunk * near) + copy;
         uint32_t pos = 0;
         MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
@@ -215,7 +295,7 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
             }
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             uint32_t disk_num = chunk % array_info.raid_disks;
@@ -258,73 +338,32 @@ NTSTATUS set_pdo::read_raid10_odd(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
-        }
-    }
+            ctxs[i].time_read();
 
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
     }
 
-    if (tmpbuf) {
-        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
-
-        RtlCopyMemory(dest, tmpbuf + skip_first, length - skip_first);
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    if (dummy_mdl)
-        IoFreeMdl(dummy_mdl);
-
-    if (dummypage)
-        ExFreePool(dummypage);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
 
 NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
     uint8_t far = (array_info.layout >> 8) & 0xff;
     uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Read.Length;
     uint32_t stripe_length = array_info.chunksize * 512;
     uint64_t start_chunk = offset / stripe_length;
     uint64_t end_chunk = (offset + length - 1) / stripe_length;
-    void* dummypage = nullptr;
-    PMDL dummy_mdl = nullptr;
-    uint8_t far_offset = read_device % far;
-
     if (start_chunk == end_chunk) { // small reads, on one device
+        uint32_t far_offset = choose_copy(start_chunk, far);
         uint64_t start = (((start_chunk / array_info.raid_disks) * far) + far_offset) * stripe_length;
         auto c = child_list[(start_chunk + far_offset) % array_info.raid_disks];
 
@@ -338,6 +377,8 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
 
+        time_read(Irp, c);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -350,19 +391,27 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
 
     uint64_t startoff, endoff;
     uint32_t startoffstripe, endoffstripe;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     get_raid0_offset(offset, stripe_length, array_info.raid_disks, &startoff, &startoffstripe);
     get_raid0_offset(offset + length - 1, stripe_length, array_info.raid_disks, &endoff, &endoffstripe);
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     bool need_dummy = false;
 
@@ -431,9 +480,11 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
+            uint32_t far_offset = choose_copy(i, far);
             auto c = child_list[(i + far_offset) % array_info.raid_disks];
 
-            ctxs[i].Irp = IoAllocateIrp(c->device->StackSize, false);
+            ctxs[i].sc = c;
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -454,7 +505,6 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
             ctxs[i].mdl->MdlFlags |= MDL_PARTIAL;
 
             ctxs[i].Irp->MdlAddress = ctxs[i].mdl;
-            ctxs[i].sc = c;
 
             IrpSp2->FileObject = c->fileobj;
             IrpSp2->Parameters.Read.Length = (ULONG)(ctxs[i].stripe_end - ctxs[i].stripe_start);
@@ -473,9 +523,9 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
             ctxs[i].Status = STATUS_SUCCESS;
     }
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -486,27 +536,30 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
+
+        parent->skip_first = skip_first;
+        parent->copy_length = length - skip_first;
     }
 
     {
@@ -515,23 +568,23 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
         pos = 0;
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            parent->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!parent->dummypage) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
-            if (!dummy_mdl) {
+            parent->dummy_mdl = IoAllocateMdl(parent->dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
+            if (!parent->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(parent->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(parent->dummy_mdl + 1);
         }
 
         MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -541,7 +594,7 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             if (pos == 0) {
@@ -633,65 +686,24 @@ NTSTATUS set_pdo::read_raid10_offset(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(ctxs[i].sc->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
-        }
-    }
-
-    Status = STATUS_SUCCESS;
+            ctxs[i].time_read();
 
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
     }
 
-    if (tmpbuf) {
-        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
-
-        RtlCopyMemory(dest, tmpbuf + skip_first, length - skip_first);
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    if (dummy_mdl)
-        IoFreeMdl(dummy_mdl);
-
-    if (dummypage)
-        ExFreePool(dummypage);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].va)
-            ExFreePool(ctxs[i].va);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
 
 NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
 
     shared_eresource l(&lock);
 
@@ -702,7 +714,7 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
     uint8_t far = (array_info.layout >> 8) & 0xff;
     bool is_offset = array_info.layout & 0x10000;
 
-    read_device++;
+    InterlockedIncrement(&read_device);
 
     if (is_offset)
         return read_raid10_offset(Irp, no_complete);
@@ -716,8 +728,9 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
     uint64_t end_chunk = (offset + length - 1) / (array_info.chunksize * 512);
 
     if (start_chunk == end_chunk) { // small reads, on one device
-        uint32_t near_shift = read_device % near;
-        uint32_t far_shift = (read_device % (far * near)) / near;
+        uint32_t copy = choose_copy(near * (start_chunk % (array_info.raid_disks / near)), far * near);
+        uint32_t near_shift = copy % near;
+        uint32_t far_shift = copy / near;
         uint32_t disk_num = ((near * (start_chunk % (array_info.raid_disks / near))) + near_shift + (far_shift * near)) % array_info.raid_disks;
 
         auto c = child_list[disk_num];
@@ -735,6 +748,8 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
 
+        time_read(Irp, c);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -742,8 +757,6 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
 
     uint64_t startoff, endoff;
     uint32_t startoffstripe, endoffstripe;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     uint32_t stripe_length = array_info.chunksize * 512;
 
@@ -755,13 +768,23 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
     get_raid0_offset(offset, stripe_length, array_info.raid_disks / near, &startoff, &startoffstripe);
     get_raid0_offset(offset + length - 1, stripe_length, array_info.raid_disks / near, &endoff, &endoffstripe);
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks / near, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks / near);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks / near);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks / near;
 
     for (unsigned int i = 0; i < array_info.raid_disks / near; i++) {
         if (startoffstripe > i)
@@ -781,14 +804,15 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
 
     NTSTATUS Status;
 
-    uint32_t near_shift = read_device % near;
-    uint32_t far_shift = (read_device % (far * near)) / near;
-
     for (unsigned int i = 0; i < array_info.raid_disks / near; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
+            uint32_t copy = choose_copy(near * i, far * near);
+            uint32_t near_shift = copy % near;
+            uint32_t far_shift = copy / near;
             uint32_t disk_num = ((near * i) + near_shift + (far_shift * near)) % array_info.raid_disks;
 
-            ctxs[i].Irp = IoAllocateIrp(child_list[disk_num]->device->StackSize, false);
+            ctxs[i].sc = child_list[disk_num];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -809,7 +833,6 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
             ctxs[i].mdl->MdlFlags |= MDL_PARTIAL;
 
             ctxs[i].Irp->MdlAddress = ctxs[i].mdl;
-            ctxs[i].sc = child_list[disk_num];
 
             IrpSp2->FileObject = child_list[disk_num]->fileobj;
             IrpSp2->Parameters.Read.Length = (ULONG)(ctxs[i].stripe_end - ctxs[i].stripe_start);
@@ -828,9 +851,9 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
             ctxs[i].Status = STATUS_SUCCESS;
     }
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -841,27 +864,30 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
+
+        parent->skip_first = skip_first;
+        parent->copy_length = length - skip_first;
     }
 
     {
@@ -874,7 +900,7 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             uint32_t len, pages;
@@ -914,80 +940,57 @@ NTSTATUS set_pdo::read_raid10(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks / near; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(ctxs[i].sc->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
-        }
-    }
-
-    Status = STATUS_SUCCESS;
+            ctxs[i].time_read();
 
-    for (unsigned int i = 0; i < array_info.raid_disks / near; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
     }
 
-    if (tmpbuf) {
-        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
-
-        RtlCopyMemory(dest, tmpbuf + skip_first, length - skip_first);
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    for (unsigned int i = 0; i < array_info.raid_disks / near; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
 
-NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
+NTSTATUS set_pdo::write_raid10_odd(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
     uint8_t near = array_info.layout & 0xff;
     uint32_t stripe_length = array_info.chunksize * 512;
     uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Write.Length;
     uint64_t start_chunk = offset / stripe_length;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
     NTSTATUS Status;
 
     uint32_t skip_first = offset % PAGE_SIZE ? (PAGE_SIZE - (offset % PAGE_SIZE)) : 0;
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->in_flight = &writes_in_flight;
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
-    klist<io_context> first_bits;
+    auto& first_bits = parent->ctx_list;
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -998,7 +1001,7 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
@@ -1011,7 +1014,7 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
         for (uint32_t i = 0; i < near; i++) {
             uint32_t disk_num = (chunk + i) % array_info.raid_disks;
 
-            first_bits.emplace_back_np(child_list[disk_num], 0, 0);
+            first_bits.emplace_back_np(child_list[disk_num], 0, 0, &pool);
 
             auto& last = first_bits.back();
 
@@ -1086,7 +1089,8 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
 
         for (unsigned int i = 0; i < array_info.raid_disks; i++) {
             if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-                ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+                ctxs[i].sc = child_list[i];
+                ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
                 if (!ctxs[i].Irp) {
                     ERR("IoAllocateIrp failed\n");
@@ -1123,25 +1127,25 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
         }
 
         if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-            tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-            if (!tmpbuf) {
+            parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            if (!parent->tmpbuf) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-            if (!tmpmdl) {
+            parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+            if (!parent->tmpmdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(tmpmdl);
+            MmBuildMdlForNonPagedPool(parent->tmpmdl);
 
             auto data = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
-            RtlCopyMemory(tmpbuf, (uint8_t*)data + skip_first, length);
+            RtlCopyMemory(parent->tmpbuf, (uint8_t*)data + skip_first, length);
         }
 
         {
@@ -1154,7 +1158,7 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
                     ctxs[i].pfns = ctxs[i].pfnp = MmGetMdlPfnArray(ctxs[i].mdl);
             }
 
-            auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+            auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
             while (pos < length) {
                 uint32_t len, pages;
@@ -1187,9 +1191,9 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
     }
 
@@ -1197,65 +1201,18 @@ NTSTATUS set_pdo::write_raid10_odd(PIRP Irp) {
         LIST_ENTRY* le = first_bits.list.Flink;
 
         while (le != &first_bits.list) {
-            auto& fb = first_bits.entry(le);
-
-            fb.Status = IoCallDriver(fb.sc->device, fb.Irp);
-            if (!NT_SUCCESS(fb.Status))
-                ERR("IoCallDriver returned %08x\n", fb.Status);
+            Status = parent->call(first_bits.entry(le));
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
 
             le = le->Flink;
         }
     }
 
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
-        }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
-    }
-
-    if (skip_first != 0) {
-        LIST_ENTRY* le = first_bits.list.Flink;
-
-        while (le != &first_bits.list) {
-            auto& fb = first_bits.entry(le);
-
-            if (fb.Status == STATUS_PENDING) {
-                KeWaitForSingleObject(&fb.Event, Executive, KernelMode, false, nullptr);
-                fb.Status = fb.iosb.Status;
-            }
-
-            if (!NT_SUCCESS(fb.Status))
-                Status = fb.Status;
-
-            le = le->Flink;
-        }
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
@@ -1278,7 +1235,7 @@ NTSTATUS set_pdo::write_raid10_offset_partial(klist<io_context>& ctxs, uint64_t
         uint32_t len = min(length - pos, i == startoffstripe ? (stripe_length - (startoff % stripe_length)) : stripe_length);
 
         auto c = child_list[i];
-        ctxs.emplace_back_np(c, stripe_start + (c->disk_info.data_offset * 512), stripe_start + (c->disk_info.data_offset * 512) + len);
+        ctxs.emplace_back_np(c, stripe_start + (c->disk_info.data_offset * 512), stripe_start + (c->disk_info.data_offset * 512) + len, &pool);
         auto& ctxa = ctxs.back();
 
         ctxa.mdl = IoAllocateMdl(nullptr, len + mdl_offset, false, false, nullptr);
@@ -1306,7 +1263,7 @@ NTSTATUS set_pdo::write_raid10_offset_partial(klist<io_context>& ctxs, uint64_t
         for (uint32_t k = 1; k < far; k++) {
             auto c = child_list[(i + 1) % array_info.raid_disks];
             ctxs.emplace_back_np(c, stripe_start + (k * stripe_length) + (c->disk_info.data_offset * 512),
-                                 stripe_start + len + (k * stripe_length) + (c->disk_info.data_offset * 512));
+                                 stripe_start + len + (k * stripe_length) + (c->disk_info.data_offset * 512), &pool);
 
             auto& ctxb = ctxs.back();
 
@@ -1319,18 +1276,26 @@ NTSTATUS set_pdo::write_raid10_offset_partial(klist<io_context>& ctxs, uint64_t
     return STATUS_SUCCESS;
 }
 
-NTSTATUS set_pdo::write_raid10_offset(PIRP Irp) {
+NTSTATUS set_pdo::write_raid10_offset(PIRP Irp, bool* no_complete) {
     NTSTATUS Status;
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
     uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Write.Length;
     uint32_t stripe_length = array_info.chunksize * 512;
     uint32_t full_stripe = array_info.raid_disks * stripe_length;
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->in_flight = &writes_in_flight;
+    parent->rundown = &io_rundown;
+
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -1341,12 +1306,13 @@ NTSTATUS set_pdo::write_raid10_offset(PIRP Irp) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
+            delete parent;
             return Status;
         }
     }
 
-    klist<io_context> ctxs;
+    auto& ctxs = parent->ctx_list;
 
     auto src_pfns = MmGetMdlPfnArray(Irp->MdlAddress);
     uint32_t mdl_offset = Irp->MdlAddress->ByteOffset;
@@ -1406,13 +1372,14 @@ NTSTATUS set_pdo::write_raid10_offset(PIRP Irp) {
 
         for (uint32_t i = 0; i < array_info.raid_disks; i++) {
             auto c = child_list[i];
-            ctxs.emplace_back_np(c, stripe_start + (c->disk_info.data_offset * 512), stripe_start + (c->disk_info.data_offset * 512) + len);
+            ctxs.emplace_back_np(c, stripe_start + (c->disk_info.data_offset * 512), stripe_start + (c->disk_info.data_offset * 512) + len, &pool);
             auto& ctxa = ctxs.back();
 
             ctxa.mdl = IoAllocateMdl(nullptr, len + mdl_offset, false, false, nullptr);
             if (!ctxa.mdl) {
                 ERR("IoAllocateMdl failed\n");
-                return STATUS_INSUFFICIENT_RESOURCES;
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
             }
 
             ctxa.mdl->MdlFlags |= MDL_PARTIAL;
@@ -1457,46 +1424,32 @@ NTSTATUS set_pdo::write_raid10_offset(PIRP Irp) {
             IrpSp->Parameters.Write.ByteOffset.QuadPart = ctx.stripe_start;
             IrpSp->Parameters.Write.Length = (ULONG)(ctx.stripe_end - ctx.stripe_start);
 
-            ctx.Status = IoCallDriver(ctx.sc->device, ctx.Irp);
-
             le = le->Flink;
         }
     }
 
-    Status = STATUS_SUCCESS;
-
     {
         LIST_ENTRY* le = ctxs.list.Flink;
         while (le != &ctxs.list) {
-            auto& ctx = ctxs.entry(le);
-
-            if (ctx.Status == STATUS_PENDING) {
-                KeWaitForSingleObject(&ctx.Event, Executive, KernelMode, false, nullptr);
-                ctx.Status = ctx.iosb.Status;
-            }
-
-            if (!NT_SUCCESS(ctx.Status)) {
-                ERR("writing returned %08x\n", ctx.Status);
-                Status = ctx.Status;
-            }
+            Status = parent->call(ctxs.entry(le));
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
 
             le = le->Flink;
         }
     }
 
+    return parent->pend(no_complete);
+
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
+    delete parent;
 
     return Status;
 }
 
-NTSTATUS set_pdo::write_raid10(PIRP Irp) {
+NTSTATUS set_pdo::write_raid10(PIRP Irp, bool* no_complete) {
     NTSTATUS Status;
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     if (array_info.chunksize == 0 || (array_info.chunksize * 512) % PAGE_SIZE != 0)
         return STATUS_INTERNAL_ERROR;
@@ -1506,10 +1459,10 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
     bool is_offset = array_info.layout & 0x10000;
 
     if (is_offset)
-        return write_raid10_offset(Irp);
+        return write_raid10_offset(Irp, no_complete);
 
     if (array_info.raid_disks % near != 0)
-        return write_raid10_odd(Irp);
+        return write_raid10_odd(Irp, no_complete);
 
     uint64_t startoff, endoff;
     uint32_t startoffstripe, endoffstripe;
@@ -1519,22 +1472,30 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
     uint32_t length = IrpSp->Parameters.Write.Length;
     uint32_t skip_first = offset % PAGE_SIZE ? (PAGE_SIZE - (offset % PAGE_SIZE)) : 0;
 
-    np_buffer ctxs_buf(sizeof(io_context) * array_info.raid_disks * far);
-
-    if (!ctxs_buf.buf) {
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    auto ctxs = (io_context*)ctxs_buf.buf;
+    parent->in_flight = &writes_in_flight;
+    parent->rundown = &io_rundown;
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks * far);
+    auto ctxs = pool.get_ctxs(array_info.raid_disks * far);
+    if (!ctxs) {
+        ERR("out of memory\n");
+        delete parent;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks * far;
 
-    klist<io_context> first_bits;
+    auto& first_bits = parent->ctx_list;
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -1545,7 +1506,7 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
@@ -1557,7 +1518,7 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
 
         for (uint32_t j = 0; j < far; j++) {
             for (uint32_t i = 0; i < near; i++) {
-                first_bits.emplace_back_np(child_list[((startoffstripe * near) + i + (j * near)) % array_info.raid_disks], 0, 0);
+                first_bits.emplace_back_np(child_list[((startoffstripe * near) + i + (j * near)) % array_info.raid_disks], 0, 0, &pool);
 
                 auto& last = first_bits.back();
 
@@ -1634,7 +1595,8 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
                         auto ctx = &ctxs[(near * far * i) + (j * far) + k];
                         uint32_t disk_num = ((near * i) + j + (k * near)) % array_info.raid_disks;
 
-                        ctx->Irp = IoAllocateIrp(child_list[disk_num]->device->StackSize, false);
+                        ctx->sc = child_list[disk_num];
+                        ctx->Irp = pool.get_irp(*ctx);
 
                         if (!ctx->Irp) {
                             ERR("IoAllocateIrp failed\n");
@@ -1642,8 +1604,6 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
                             goto end;
                         }
 
-                        ctx->sc = child_list[disk_num];
-
                         auto IrpSp2 = IoGetNextIrpStackLocation(ctx->Irp);
                         IrpSp2->MajorFunction = IRP_MJ_WRITE;
 
@@ -1673,25 +1633,25 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
         }
 
         if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-            tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-            if (!tmpbuf) {
+            parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+            if (!parent->tmpbuf) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-            if (!tmpmdl) {
+            parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+            if (!parent->tmpmdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(tmpmdl);
+            MmBuildMdlForNonPagedPool(parent->tmpmdl);
 
             auto data = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
-            RtlCopyMemory(tmpbuf, (uint8_t*)data + skip_first, length);
+            RtlCopyMemory(parent->tmpbuf, (uint8_t*)data + skip_first, length);
         }
 
         {
@@ -1704,7 +1664,7 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
                     ctxs[i * near * far].pfnp = MmGetMdlPfnArray(ctxs[i * near * far].mdl);
             }
 
-            auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+            auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
             while (pos < length) {
                 auto ctxa = &ctxs[stripe * near * far];
@@ -1747,9 +1707,9 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
 
     for (unsigned int i = 0; i < array_info.raid_disks * far; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(ctxs[i].sc->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
     }
 
@@ -1757,63 +1717,18 @@ NTSTATUS set_pdo::write_raid10(PIRP Irp) {
         LIST_ENTRY* le = first_bits.list.Flink;
 
         while (le != &first_bits.list) {
-            auto& fb = first_bits.entry(le);
-
-            fb.Status = IoCallDriver(fb.sc->device, fb.Irp);
-            if (!NT_SUCCESS(fb.Status))
-                ERR("IoCallDriver returned %08x\n", fb.Status);
+            Status = parent->call(first_bits.entry(le));
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
 
             le = le->Flink;
         }
     }
 
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks * far; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
-        }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
-    }
-
-    if (skip_first != 0) {
-        LIST_ENTRY* le = first_bits.list.Flink;
-
-        while (le != &first_bits.list) {
-            auto& fb = first_bits.entry(le);
-
-            if (fb.Status == STATUS_PENDING) {
-                KeWaitForSingleObject(&fb.Event, Executive, KernelMode, false, nullptr);
-                fb.Status = fb.iosb.Status;
-            }
-
-            if (!NT_SUCCESS(fb.Status))
-                Status = fb.Status;
-
-            le = le->Flink;
-        }
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    for (unsigned int i = 0; i < array_info.raid_disks * far; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
@@ -19,13 +19,8 @@
 
 NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
     uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Read.Length;
-    void* dummypage = nullptr;
-    PMDL dummy_mdl = nullptr;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     shared_eresource l(&lock);
 
@@ -39,6 +34,9 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
     if (array_info.chunksize == 0 || (array_info.chunksize * 512) % PAGE_SIZE != 0)
         return STATUS_INTERNAL_ERROR;
 
+    if (read_partial_chunks(Irp, offset, length))
+        return STATUS_SUCCESS;
+
     uint64_t startoff, endoff;
     uint32_t startoffstripe, endoffstripe;
     uint32_t stripe_length = array_info.chunksize * 512;
@@ -67,6 +65,8 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
 
+        IoSetCompletionRoutine(Irp, passthrough_completion, this, true, true, true);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -78,13 +78,23 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
     offset -= skip_first;
     length += skip_first;
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     bool need_dummy = false;
 
@@ -182,7 +192,8 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -218,9 +229,9 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
             ctxs[i].Status = STATUS_SUCCESS;
     }
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -231,27 +242,30 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
+
+        parent->skip_first = skip_first;
+        parent->copy_length = length - skip_first;
     }
 
     {
@@ -259,23 +273,23 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
         PFN_NUMBER dummy;
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            parent->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!parent->dummypage) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
-            if (!dummy_mdl) {
+            parent->dummy_mdl = IoAllocateMdl(parent->dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
+            if (!parent->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(parent->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(parent->dummy_mdl + 1);
         }
 
         MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -285,7 +299,7 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             auto parity = get_parity_volume(offset + pos);
@@ -397,58 +411,16 @@ NTSTATUS set_pdo::read_raid45(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
-        }
-    }
-
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
     }
 
-    if (tmpbuf) {
-        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
-
-        RtlCopyMemory(dest, tmpbuf + skip_first, length - skip_first);
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    if (dummy_mdl)
-        IoFreeMdl(dummy_mdl);
-
-    if (dummypage)
-        ExFreePool(dummypage);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].va)
-            ExFreePool(ctxs[i].va);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
@@ -463,7 +435,7 @@ void set_pdo::paranoid_raid5_check(uint64_t parity_offset, uint32_t parity_lengt
     klist<io_context> ctxs;
 
     for (uint32_t i = 0; i < array_info.raid_disks; i++) {
-        ctxs.emplace_back_np(child_list[i], read_offset + (child_list[i]->disk_info.data_offset * 512), parity_length);
+        ctxs.emplace_back_np(child_list[i], read_offset + (child_list[i]->disk_info.data_offset * 512), parity_length, &pool);
         auto& last = ctxs.back();
 
         if (!NT_SUCCESS(last.Status)) {
@@ -547,10 +519,6 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
     uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart, parity_offset = offset;
     uint32_t length = IrpSp->Parameters.Write.Length, parity_length = length;
     uint8_t* data;
-    uint8_t* parity_data = nullptr;
-    PMDL parity_mdl = nullptr;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     if (array_info.level == RAID_LEVEL_5 && array_info.layout != RAID_LAYOUT_LEFT_SYMMETRIC &&
         array_info.layout != RAID_LAYOUT_RIGHT_SYMMETRIC && array_info.layout != RAID_LAYOUT_LEFT_ASYMMETRIC &&
@@ -566,14 +534,26 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
         return STATUS_INVALID_PARAMETER;
 
     uint32_t full_chunk = array_info.chunksize * 512 * (array_info.raid_disks - 1);
-    bool mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
     io_context* ctxs = nullptr;
     uint64_t startoff, endoff, start_chunk, end_chunk;
     uint32_t startoffstripe, endoffstripe, stripe_length, pos;
     uint32_t skip_first = offset % PAGE_SIZE ? (PAGE_SIZE - (offset % PAGE_SIZE)) : 0;
-    io_context first_bit;
+    bool write_back;
+
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->in_flight = &writes_in_flight;
+    parent->rundown = &io_rundown;
+
+    auto& first_bit = parent->first_bit;
 
-    if (!mdl_locked) {
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -584,15 +564,21 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     data = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
+    // A write within a single stripe is left in the cache, and goes to disk along with its parity
+    // when it's flushed - which means the old data is still there if the flush wants it. Anything
+    // bigger is written through, as is anything the caller wants on disk straight away.
+    write_back = offset / full_chunk == (offset + length - 1) / full_chunk && length < full_chunk &&
+                 !(IrpSp->Flags & SL_WRITE_THROUGH);
+
     if (offset % full_chunk != 0) {
-        Status = add_partial_chunk(offset, min(length, full_chunk - (offset % full_chunk)), data);
+        Status = add_partial_chunk(offset, min(length, full_chunk - (offset % full_chunk)), data, write_back);
         if (!NT_SUCCESS(Status))
             goto end;
 
@@ -604,13 +590,25 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
     if (parity_length % full_chunk != 0) {
         // FIXME - don't call if covered by previous add_partial_chunk
         Status = add_partial_chunk(parity_offset + parity_length - (parity_length % full_chunk), parity_length % full_chunk,
-                                   data + parity_offset - offset + parity_length - (parity_length % full_chunk));
+                                   data + parity_offset - offset + parity_length - (parity_length % full_chunk), write_back);
         if (!NT_SUCCESS(Status))
             goto end;
 
         parity_length -= parity_length % full_chunk;
     }
 
+    if (write_back)
+        goto end;
+
+    // Whole stripes bypass the cache, so anything it has for them is now out of date. They stay
+    // locked until the write completes, so that flushes don't see them half-written.
+    if (parity_length > 0) {
+        drop_partial_chunks(parity_offset, parity_length);
+
+        lock_stripes(&parent->stripes, parity_offset, parity_length);
+        parent->locked_set = this;
+    }
+
     stripe_length = array_info.chunksize * 512;
 
     get_raid0_offset(offset, stripe_length, array_info.raid_disks - 1, &startoff, &startoffstripe);
@@ -637,8 +635,14 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Write.ByteOffset.QuadPart = start;
 
+        IoSetCompletionRoutine(Irp, write_completion, this, true, true, true);
+
         *no_complete = true;
 
+        // pages stay locked until the IRP itself is completed
+        parent->mdl_locked = true;
+        delete parent;
+
         return IoCallDriver(c->device, Irp);
     }
 
@@ -646,7 +650,7 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
         auto parity = get_parity_volume(offset);
         uint32_t disk_num = get_physical_stripe(startoffstripe, parity);
         first_bit.sc = child_list[disk_num];
-        first_bit.Irp = IoAllocateIrp(first_bit.sc->device->StackSize, false);
+        first_bit.Irp = pool.get_irp(first_bit);
 
         if (!first_bit.Irp) {
             ERR("IoAllocateIrp failed\n");
@@ -692,14 +696,15 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
         get_raid0_offset(offset, stripe_length, array_info.raid_disks - 1, &startoff, &startoffstripe);
     }
 
-    ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     pos = 0;
     while (pos < length) {
@@ -797,7 +802,8 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -839,23 +845,23 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
 
-        RtlCopyMemory(tmpbuf, (uint8_t*)data + skip_first, length);
+        RtlCopyMemory(parent->tmpbuf, (uint8_t*)data + skip_first, length);
     }
 
     {
@@ -865,33 +871,48 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
         PFN_NUMBER* parity_pfns = nullptr;
 
         if (parity_length > 0) {
-            parity_data = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, parity_length, ALLOC_TAG);
-            if (!parity_data) {
+            parent->parity_pool = &pool;
+            parent->parity_alloc = parity_length;
+
+            parent->parity_data = pool.get_parity(parity_length);
+            if (!parent->parity_data) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            parity_mdl = IoAllocateMdl(parity_data, parity_length, false, false, nullptr);
-            if (!parity_mdl) {
+            parent->parity_mdl = IoAllocateMdl(parent->parity_data, parity_length, false, false, nullptr);
+            if (!parent->parity_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(parity_mdl);
+            MmBuildMdlForNonPagedPool(parent->parity_mdl);
+
+            pp = parent->parity_data;
+            parity_pfns = MmGetMdlPfnArray(parent->parity_mdl);
+        }
+
+        // each full stripe gets its own list of sources, so their parity can be done in parallel
+        np_buffer xor_buf(sizeof(uint8_t*) * (array_info.raid_disks - 1) * max(parity_length / full_chunk, 1u));
 
-            pp = parity_data;
-            parity_pfns = MmGetMdlPfnArray(parity_mdl);
+        if (!xor_buf.buf) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
 
+        auto xor_srcs = (uint8_t**)xor_buf.buf;
+        parity_batch batch(parity_length / (array_info.raid_disks - 1));
+
         for (unsigned int i = 0; i < array_info.raid_disks; i++) {
             if (ctxs[i].mdl)
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
         auto addr = data;
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             auto parity = get_parity_volume(offset + pos);
@@ -934,14 +955,9 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
             } else if (length - pos >= stripe_length * (array_info.raid_disks - 1)) {
                 uint32_t stripe = get_physical_stripe(0, parity);
                 uint32_t pages = stripe_length / PAGE_SIZE;
-                bool first = true;
 
                 for (uint32_t i = 0; i < array_info.raid_disks - 1; i++) {
-                    if (first) {
-                        RtlCopyMemory(pp, addr, stripe_length);
-                        first = false;
-                    } else
-                        do_xor(pp, addr, stripe_length);
+                    xor_srcs[i] = addr;
 
                     pos += stripe_length;
                     addr += stripe_length;
@@ -959,6 +975,9 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
                         stripe = (stripe + 1) % array_info.raid_disks;
                 }
 
+                batch.add(array_info.raid_disks - 1, 0, stripe_length, xor_srcs, pp, nullptr);
+
+                xor_srcs += array_info.raid_disks - 1;
                 pp = &pp[stripe_length];
 
                 RtlCopyMemory(ctxs[parity].pfnp, parity_pfns, sizeof(PFN_NUMBER) * pages);
@@ -993,79 +1012,39 @@ NTSTATUS set_pdo::write_raid45(PIRP Irp, bool* no_complete) {
                 }
             }
         }
-    }
 
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
-        }
+        batch.run();
     }
 
-    if (skip_first != 0) {
-        first_bit.Status = IoCallDriver(first_bit.sc->device, first_bit.Irp);
-        if (!NT_SUCCESS(first_bit.Status))
-            ERR("IoCallDriver returned %08x\n", first_bit.Status);
-    }
-
-    Status = STATUS_SUCCESS;
-
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+        if (ctxs[i].Irp) {
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
     }
 
     if (skip_first != 0) {
-        if (first_bit.Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&first_bit.Event, Executive, KernelMode, false, nullptr);
-            first_bit.Status = first_bit.iosb.Status;
-        }
-
-        if (!NT_SUCCESS(first_bit.Status))
-            Status = first_bit.Status;
+        Status = parent->call(first_bit);
+        if (!NT_SUCCESS(Status))
+            ERR("IoCallDriver returned %08x\n", Status);
     }
 
 #ifdef DEBUG_PARANOID
+    Status = parent->wait();
+
     if (parity_length != 0)
         paranoid_raid5_check(parity_offset, parity_length);
-#endif
-
-end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    if (parity_mdl)
-        IoFreeMdl(parity_mdl);
-
-    if (parity_data)
-        ExFreePool(parity_data);
-
-    if (ctxs) {
-        for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-            if (ctxs[i].mdl)
-                IoFreeMdl(ctxs[i].mdl);
 
-            if (ctxs[i].va)
-                ExFreePool(ctxs[i].va);
+    delete parent;
 
-            if (ctxs[i].Irp)
-                IoFreeIrp(ctxs[i].Irp);
-        }
-
-        ExFreePool(ctxs);
-    }
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
+    return Status;
+#else
+    return parent->pend(no_complete);
+#endif
 
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+end:
+    delete parent;
 
     return Status;
 }
@@ -1080,14 +1059,33 @@ NTSTATUS set_pdo::flush_partial_chunk_raid45(partial_chunk* pc, RTL_BITMAP* vali
     uint32_t data_disks = array_info.raid_disks - 1;
     uint32_t chunk_size = array_info.chunksize * 512;
 
+    np_buffer p(chunk_size);
+
+    if (!p.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    np_buffer xor_buf(sizeof(uint8_t*) * data_disks);
+
+    if (!xor_buf.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    auto xor_srcs = (uint8_t**)xor_buf.buf;
+    parity_batch batch(chunk_size);
+
+    for (uint32_t i = 0; i < data_disks; i++) {
+        xor_srcs[i] = pc->data + (i * chunk_size);
+    }
+
     while (runlength != 0) {
-        for (uint32_t i = 1; i < data_disks; i++) {
-            do_xor(pc->data + (index * 512), pc->data + (i * chunk_size) + (index * 512), runlength * 512);
-        }
+        batch.add(data_disks, index * pc_block, (index + runlength) * pc_block, xor_srcs, p.buf, nullptr);
 
-        uint64_t stripe_start = (pc->offset / data_disks) + (index * 512) + (parity_dev->disk_info.data_offset * 512);
+        uint64_t stripe_start = (pc->offset / data_disks) + (index * pc_block) + (parity_dev->disk_info.data_offset * 512);
 
-        ctxs.emplace_back_np(parity_dev, stripe_start, stripe_start + (runlength * 512));
+        ctxs.emplace_back_np(parity_dev, stripe_start, stripe_start + (runlength * pc_block), &pool);
 
         auto last = &ctxs.back();
 
@@ -1096,11 +1094,18 @@ NTSTATUS set_pdo::flush_partial_chunk_raid45(partial_chunk* pc, RTL_BITMAP* vali
             return last->Status;
         }
 
-        last->va2 = pc->data + (index * 512);
+        last->va2 = p.buf + (index * pc_block);
 
         runlength = RtlFindNextForwardRunClear(valid_bmp, index + runlength, &index);
     }
 
+    batch.run();
+
+    // the new data goes to disk at the same time as the parity
+    Status = add_block_ctxs(ctxs, pc, 0, chunk_size * data_disks, true, pc->data);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
     if (!ctxs.empty()) {
         LIST_ENTRY* le = ctxs.list.Flink;
         while (le != &ctxs.list) {
@@ -1123,33 +1128,100 @@ NTSTATUS set_pdo::flush_partial_chunk_raid45(partial_chunk* pc, RTL_BITMAP* vali
             IrpSp->Parameters.Write.ByteOffset.QuadPart = ctx.stripe_start;
             IrpSp->Parameters.Write.Length = (ULONG)(ctx.stripe_end - ctx.stripe_start);
 
-            ctx.Status = IoCallDriver(ctx.sc->device, ctx.Irp);
-
             le = le->Flink;
         }
 
-        Status = STATUS_SUCCESS;
+        io_parent parent(nullptr);
 
         le = ctxs.list.Flink;
         while (le != &ctxs.list) {
-            auto& ctx = ctxs.entry(le);
-
-            if (ctx.Status == STATUS_PENDING) {
-                KeWaitForSingleObject(&ctx.Event, Executive, KernelMode, false, nullptr);
-                ctx.Status = ctx.iosb.Status;
-            }
-
-            if (!NT_SUCCESS(ctx.Status)) {
-                ERR("writing returned %08x\n", ctx.Status);
-                Status = ctx.Status;
-            }
+            parent.call(ctxs.entry(le));
 
             le = le->Flink;
         }
 
-        if (!NT_SUCCESS(Status))
+        Status = parent.wait();
+        if (!NT_SUCCESS(Status)) {
+            ERR("writing returned %08x\n", Status);
             return Status;
+        }
     }
 
     return STATUS_SUCCESS;
 }
+
+// Read-modify-write: P' = P ^ dD, where dD is the difference between the old and new data.
+// The old data is still on disk, as the new data only goes there now, along with the parity.
+NTSTATUS set_pdo::flush_partial_chunk_raid45_rmw(partial_chunk* pc, RTL_BITMAP* valid_bmp) {
+    NTSTATUS Status;
+    klist<io_context> read_ctxs, write_ctxs;
+    ULONG index, runlength;
+    uint32_t data_disks = array_info.raid_disks - 1;
+    uint32_t chunk_size = array_info.chunksize * 512;
+
+    np_buffer p(chunk_size);
+
+    if (!p.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    np_buffer old(chunk_size * data_disks);
+
+    if (!old.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = add_parity_ctxs(read_ctxs, pc, valid_bmp, p.buf, nullptr);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = add_block_ctxs(read_ctxs, pc, 0, chunk_size * data_disks, true, old.buf);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = sync_io(read_ctxs, false);
+    if (!NT_SUCCESS(Status)) {
+        ERR("reading returned %08x\n", Status);
+        return Status;
+    }
+
+    for (uint32_t i = 0; i < data_disks; i++) {
+        ULONG start = i * pc_rows, end = start + pc_rows;
+
+        // clear bits are the blocks we've written to
+        runlength = RtlFindNextForwardRunClear(&pc->bmp, start, &index);
+
+        while (runlength != 0 && index < end) {
+            runlength = min(runlength, end - index);
+
+            auto delta = old.buf + (index * pc_block);
+
+            do_xor(delta, pc->data + (index * pc_block), runlength * pc_block);
+            do_xor(p.buf + ((index - start) * pc_block), delta, runlength * pc_block);
+
+            runlength = RtlFindNextForwardRunClear(&pc->bmp, index + runlength, &index);
+        }
+    }
+
+    Status = add_parity_ctxs(write_ctxs, pc, valid_bmp, p.buf, nullptr);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = add_block_ctxs(write_ctxs, pc, 0, chunk_size * data_disks, true, pc->data);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = sync_io(write_ctxs, true);
+    if (!NT_SUCCESS(Status)) {
+        ERR("writing returned %08x\n", Status);
+        return Status;
+    }
+
+#ifdef DEBUG_PARANOID
+    paranoid_raid5_check(pc->offset, chunk_size * data_disks);
+#endif
+
+    return STATUS_SUCCESS;
+}
@@ -19,13 +19,8 @@
 
 NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
     auto IrpSp = IoGetCurrentIrpStackLocation(Irp);
-    bool mdl_locked = true;
     uint64_t offset = IrpSp->Parameters.Read.ByteOffset.QuadPart;
     uint32_t length = IrpSp->Parameters.Read.Length;
-    void* dummypage = nullptr;
-    PMDL dummy_mdl = nullptr;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     shared_eresource l(&lock);
 
@@ -38,6 +33,9 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
     if (array_info.chunksize == 0 || (array_info.chunksize * 512) % PAGE_SIZE != 0)
         return STATUS_INTERNAL_ERROR;
 
+    if (read_partial_chunks(Irp, offset, length))
+        return STATUS_SUCCESS;
+
     uint64_t startoff, endoff;
     uint32_t startoffstripe, endoffstripe;
     uint32_t stripe_length = array_info.chunksize * 512;
@@ -66,6 +64,8 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Read.ByteOffset.QuadPart = start;
 
+        IoSetCompletionRoutine(Irp, passthrough_completion, this, true, true, true);
+
         *no_complete = true;
 
         return IoCallDriver(c->device, Irp);
@@ -77,13 +77,23 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
     offset -= skip_first;
     length += skip_first;
 
-    auto ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->rundown = &io_rundown;
+
+    auto ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
+        delete parent;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     bool need_dummy = false;
 
@@ -182,7 +192,8 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -218,9 +229,9 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
             ctxs[i].Status = STATUS_SUCCESS;
     }
 
-    mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
 
-    if (!mdl_locked) {
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -231,27 +242,30 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
+
+        parent->skip_first = skip_first;
+        parent->copy_length = length - skip_first;
     }
 
     {
@@ -259,23 +273,23 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
         PFN_NUMBER dummy;
 
         if (need_dummy) {
-            dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
-            if (!dummypage) {
+            parent->dummypage = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, ALLOC_TAG);
+            if (!parent->dummypage) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            dummy_mdl = IoAllocateMdl(dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
-            if (!dummy_mdl) {
+            parent->dummy_mdl = IoAllocateMdl(parent->dummypage, PAGE_SIZE, FALSE, FALSE, NULL);
+            if (!parent->dummy_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(dummy_mdl);
+            MmBuildMdlForNonPagedPool(parent->dummy_mdl);
 
-            dummy = *(PFN_NUMBER*)(dummy_mdl + 1);
+            dummy = *(PFN_NUMBER*)(parent->dummy_mdl + 1);
         }
 
         MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -285,7 +299,7 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             auto parity = get_parity_volume(offset + pos);
@@ -400,109 +414,39 @@ NTSTATUS set_pdo::read_raid6(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
-        }
-    }
-
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
     }
 
-    if (tmpbuf) {
-        auto dest = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
-
-        RtlCopyMemory(dest, tmpbuf + skip_first, length - skip_first);
-    }
+    return parent->pend(no_complete);
 
 end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    if (dummy_mdl)
-        IoFreeMdl(dummy_mdl);
-
-    if (dummypage)
-        ExFreePool(dummypage);
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].mdl)
-            IoFreeMdl(ctxs[i].mdl);
-
-        if (ctxs[i].va)
-            ExFreePool(ctxs[i].va);
-
-        if (ctxs[i].Irp)
-            IoFreeIrp(ctxs[i].Irp);
-    }
-
-    ExFreePool(ctxs);
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
-
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+    delete parent;
 
     return Status;
 }
 
-// The code from the following functions is derived from the paper
-// "The mathematics of RAID-6", by H. Peter Anvin.
-// https://www.kernel.org/pub/linux/kernel/people/hpa/raid6.pdf
-
-#ifdef _AMD64_
-__inline static uint64_t galois_double_mask64(uint64_t v) {
-    v &= 0x8080808080808080;
-    return (v << 1) - (v >> 7);
-}
-#else
-__inline static uint32_t galois_double_mask32(uint32_t v) {
-    v &= 0x80808080;
-    return (v << 1) - (v >> 7);
-}
-#endif
-
-static void galois_double(uint8_t* data, uint32_t len) {
-    // FIXME - SIMD?
-
-#ifdef _AMD64_
-    while (len > sizeof(uint64_t)) {
-        uint64_t v = *((uint64_t*)data), vv;
+// Q weights the data chunks by their position in the syndrome, which is their
+// logical order, except for asymmetric layouts where parity isn't at either end:
+// there it starts from the chunk after the parity.
+uint32_t set_pdo::get_syndrome_index(uint32_t parity, uint32_t stripe) {
+    uint32_t data_disks = array_info.raid_disks - 2;
+    bool asymmetric = array_info.layout == RAID_LAYOUT_LEFT_ASYMMETRIC || array_info.layout == RAID_LAYOUT_RIGHT_ASYMMETRIC;
+    uint32_t first = 0;
 
-        vv = (v << 1) & 0xfefefefefefefefe;
-        vv ^= galois_double_mask64(v) & 0x1d1d1d1d1d1d1d1d;
-        *((uint64_t*)data) = vv;
+    if (asymmetric && parity != 0 && parity != array_info.raid_disks - 1 && parity != array_info.raid_disks - 2)
+        first = parity;
 
-        data += sizeof(uint64_t);
-        len -= sizeof(uint64_t);
-    }
-#else
-    while (len > sizeof(uint32_t)) {
-        uint32_t v = *((uint32_t*)data), vv;
-
-        vv = (v << 1) & 0xfefefefe;
-        vv ^= galois_double_mask32(v) & 0x1d1d1d1d;
-        *((uint32_t*)data) = vv;
+    return (stripe + data_disks - first) % data_disks;
+}
 
-        data += sizeof(uint32_t);
-        len -= sizeof(uint32_t);
-    }
-#endif
+void set_pdo::get_syndrome_order(uint32_t parity, uint8_t* base, uint32_t stride, uint8_t** data) {
+    uint32_t data_disks = array_info.raid_disks - 2;
 
-    while (len > 0) {
-        data[0] = (data[0] << 1) ^ ((data[0] & 0x80) ? 0x1d : 0);
-        data++;
-        len--;
+    for (uint32_t i = 0; i < data_disks; i++) {
+        data[get_syndrome_index(parity, i)] = base + (i * stride);
     }
 }
 
@@ -512,11 +456,6 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
     uint64_t offset = IrpSp->Parameters.Write.ByteOffset.QuadPart, parity_offset = offset;
     uint32_t length = IrpSp->Parameters.Write.Length, parity_length = length;
     uint8_t* data;
-    uint8_t* parity_data = nullptr;
-    uint8_t* q_data = nullptr;
-    PMDL parity_mdl = nullptr, q_mdl = nullptr;
-    uint8_t* tmpbuf = nullptr;
-    PMDL tmpmdl = nullptr;
 
     if (array_info.layout != RAID_LAYOUT_LEFT_SYMMETRIC && array_info.layout != RAID_LAYOUT_RIGHT_SYMMETRIC &&
         array_info.layout != RAID_LAYOUT_LEFT_ASYMMETRIC && array_info.layout != RAID_LAYOUT_RIGHT_ASYMMETRIC)
@@ -531,14 +470,26 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
         return STATUS_INVALID_PARAMETER;
 
     uint32_t full_chunk = array_info.chunksize * 512 * (array_info.raid_disks - 2);
-    bool mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
     io_context* ctxs = nullptr;
     uint64_t startoff, endoff, start_chunk, end_chunk;
     uint32_t startoffstripe, endoffstripe, stripe_length, pos;
     uint32_t skip_first = offset % PAGE_SIZE ? (PAGE_SIZE - (offset % PAGE_SIZE)) : 0;
-    io_context first_bit;
+    bool write_back;
+
+    auto parent = new (pool) io_parent(Irp);
+    if (!parent) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    parent->in_flight = &writes_in_flight;
+    parent->rundown = &io_rundown;
 
-    if (!mdl_locked) {
+    auto& first_bit = parent->first_bit;
+
+    parent->mdl_locked = Irp->MdlAddress->MdlFlags & (MDL_PAGES_LOCKED | MDL_PARTIAL);
+
+    if (!parent->mdl_locked) {
         Status = STATUS_SUCCESS;
 
         seh_try {
@@ -549,15 +500,21 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
 
         if (!NT_SUCCESS(Status)) {
             ERR("MmProbeAndLockPages threw exception %08x\n", Status);
-            mdl_locked = true;
+            parent->mdl_locked = true;
             goto end;
         }
     }
 
     data = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
+    // A write within a single stripe is left in the cache, and goes to disk along with its parity
+    // when it's flushed - which means the old data is still there if the flush wants it. Anything
+    // bigger is written through, as is anything the caller wants on disk straight away.
+    write_back = offset / full_chunk == (offset + length - 1) / full_chunk && length < full_chunk &&
+                 !(IrpSp->Flags & SL_WRITE_THROUGH);
+
     if (offset % full_chunk != 0) {
-        Status = add_partial_chunk(offset, min(length, full_chunk - (offset % full_chunk)), data);
+        Status = add_partial_chunk(offset, min(length, full_chunk - (offset % full_chunk)), data, write_back);
         if (!NT_SUCCESS(Status))
             goto end;
 
@@ -569,13 +526,25 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
     if (parity_length % full_chunk != 0) {
         // FIXME - don't call if covered by previous add_partial_chunk
         Status = add_partial_chunk(parity_offset + parity_length - (parity_length % full_chunk), parity_length % full_chunk,
-                                   data + parity_offset - offset + parity_length - (parity_length % full_chunk));
+                                   data + parity_offset - offset + parity_length - (parity_length % full_chunk), write_back);
         if (!NT_SUCCESS(Status))
             goto end;
 
         parity_length -= parity_length % full_chunk;
     }
 
+    if (write_back)
+        goto end;
+
+    // Whole stripes bypass the cache, so anything it has for them is now out of date. They stay
+    // locked until the write completes, so that flushes don't see them half-written.
+    if (parity_length > 0) {
+        drop_partial_chunks(parity_offset, parity_length);
+
+        lock_stripes(&parent->stripes, parity_offset, parity_length);
+        parent->locked_set = this;
+    }
+
     stripe_length = array_info.chunksize * 512;
 
     get_raid0_offset(offset, stripe_length, array_info.raid_disks - 2, &startoff, &startoffstripe);
@@ -602,8 +571,14 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
         IrpSp2->FileObject = c->fileobj;
         IrpSp2->Parameters.Write.ByteOffset.QuadPart = start;
 
+        IoSetCompletionRoutine(Irp, write_completion, this, true, true, true);
+
         *no_complete = true;
 
+        // pages stay locked until the IRP itself is completed
+        parent->mdl_locked = true;
+        delete parent;
+
         return IoCallDriver(c->device, Irp);
     }
 
@@ -611,7 +586,7 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
         auto parity = get_parity_volume(offset);
         uint32_t disk_num = get_physical_stripe(startoffstripe, parity);
         first_bit.sc = child_list[disk_num];
-        first_bit.Irp = IoAllocateIrp(first_bit.sc->device->StackSize, false);
+        first_bit.Irp = pool.get_irp(first_bit);
 
         if (!first_bit.Irp) {
             ERR("IoAllocateIrp failed\n");
@@ -657,14 +632,15 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
         get_raid0_offset(offset, stripe_length, array_info.raid_disks - 2, &startoff, &startoffstripe);
     }
 
-    ctxs = (io_context*)ExAllocatePoolWithTag(NonPagedPool, sizeof(io_context) * array_info.raid_disks, ALLOC_TAG);
+    ctxs = pool.get_ctxs(array_info.raid_disks);
     if (!ctxs) {
         ERR("out of memory\n");
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
 
-    RtlZeroMemory(ctxs, sizeof(io_context) * array_info.raid_disks);
+    parent->ctxs = ctxs;
+    parent->num_ctxs = array_info.raid_disks;
 
     pos = 0;
     while (pos < length) {
@@ -765,7 +741,8 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].stripe_end != ctxs[i].stripe_start) {
-            ctxs[i].Irp = IoAllocateIrp(child_list[i]->device->StackSize, false);
+            ctxs[i].sc = child_list[i];
+            ctxs[i].Irp = pool.get_irp(ctxs[i]);
 
             if (!ctxs[i].Irp) {
                 ERR("IoAllocateIrp failed\n");
@@ -807,23 +784,23 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
     }
 
     if (Irp->MdlAddress->ByteOffset != 0 || skip_first != 0) {
-        tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
-        if (!tmpbuf) {
+        parent->tmpbuf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, length, ALLOC_TAG);
+        if (!parent->tmpbuf) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        tmpmdl = IoAllocateMdl(tmpbuf, length, false, false, nullptr);
-        if (!tmpmdl) {
+        parent->tmpmdl = IoAllocateMdl(parent->tmpbuf, length, false, false, nullptr);
+        if (!parent->tmpmdl) {
             ERR("IoAllocateMdl failed\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
 
-        MmBuildMdlForNonPagedPool(tmpmdl);
+        MmBuildMdlForNonPagedPool(parent->tmpmdl);
 
-        RtlCopyMemory(tmpbuf, (uint8_t*)data + skip_first, length);
+        RtlCopyMemory(parent->tmpbuf, (uint8_t*)data + skip_first, length);
     }
 
     {
@@ -835,52 +812,67 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
         PFN_NUMBER* q_pfns = nullptr;
 
         if (parity_length > 0) {
-            parity_data = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, parity_length, ALLOC_TAG);
-            if (!parity_data) {
+            parent->parity_pool = &pool;
+            parent->parity_alloc = parity_length;
+
+            parent->parity_data = pool.get_parity(parity_length);
+            if (!parent->parity_data) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            parity_mdl = IoAllocateMdl(parity_data, parity_length, false, false, nullptr);
-            if (!parity_mdl) {
+            parent->parity_mdl = IoAllocateMdl(parent->parity_data, parity_length, false, false, nullptr);
+            if (!parent->parity_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(parity_mdl);
+            MmBuildMdlForNonPagedPool(parent->parity_mdl);
 
-            pp = parity_data;
-            parity_pfns = MmGetMdlPfnArray(parity_mdl);
+            pp = parent->parity_data;
+            parity_pfns = MmGetMdlPfnArray(parent->parity_mdl);
 
-            q_data = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, parity_length, ALLOC_TAG);
-            if (!q_data) {
+            parent->q_data = pool.get_parity(parity_length);
+            if (!parent->q_data) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            q_mdl = IoAllocateMdl(q_data, parity_length, false, false, nullptr);
-            if (!parity_mdl) {
+            parent->q_mdl = IoAllocateMdl(parent->q_data, parity_length, false, false, nullptr);
+            if (!parent->q_mdl) {
                 ERR("IoAllocateMdl failed\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
 
-            MmBuildMdlForNonPagedPool(q_mdl);
+            MmBuildMdlForNonPagedPool(parent->q_mdl);
 
-            pq = q_data;
-            q_pfns = MmGetMdlPfnArray(q_mdl);
+            pq = parent->q_data;
+            q_pfns = MmGetMdlPfnArray(parent->q_mdl);
         }
 
+        // each full stripe gets its own list of sources, so their parity can be done in parallel
+        np_buffer syndrome_buf(sizeof(uint8_t*) * (array_info.raid_disks - 2) * max(parity_length / full_chunk, 1u));
+
+        if (!syndrome_buf.buf) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        auto syndrome_data = (uint8_t**)syndrome_buf.buf;
+        parity_batch batch(parity_length / (array_info.raid_disks - 2));
+
         for (unsigned int i = 0; i < array_info.raid_disks; i++) {
             if (ctxs[i].mdl)
                 ctxs[i].pfnp = ctxs[i].pfns = MmGetMdlPfnArray(ctxs[i].mdl);
         }
 
         auto addr = data;
-        auto src_pfns = MmGetMdlPfnArray((tmpmdl ? tmpmdl : Irp->MdlAddress));
+        auto src_pfns = MmGetMdlPfnArray((parent->tmpmdl ? parent->tmpmdl : Irp->MdlAddress));
 
         while (pos < length) {
             auto parity = get_parity_volume(offset + pos);
@@ -923,30 +915,13 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
             } else if (length - pos >= stripe_length * (array_info.raid_disks - 2)) {
                 uint32_t pages = stripe_length / PAGE_SIZE;
 
-                uint32_t stripe;
-
-                if (!asymmetric || parity == 0 || parity == array_info.raid_disks - 1 || parity == array_info.raid_disks - 2)
-                    stripe = array_info.raid_disks - 3;
-                else
-                    stripe = (parity + array_info.raid_disks - 1) % array_info.raid_disks;
-
-                RtlCopyMemory(pq, addr + (stripe * stripe_length), stripe_length);
-
-                for (uint32_t i = 1; i < array_info.raid_disks - 2; i++) {
-                    stripe = (stripe + array_info.raid_disks - 3) % (array_info.raid_disks - 2);
-
-                    galois_double(pq, stripe_length);
-                    do_xor(pq, addr + (stripe * stripe_length), stripe_length);
-                }
+                get_syndrome_order(parity, addr, stripe_length, syndrome_data);
+                batch.add(array_info.raid_disks - 2, 0, stripe_length, syndrome_data, pp, pq);
+                syndrome_data += array_info.raid_disks - 2;
 
-                stripe = get_physical_stripe(0, parity);
+                uint32_t stripe = get_physical_stripe(0, parity);
 
                 for (uint32_t i = 0; i < array_info.raid_disks - 2; i++) {
-                    if (i == 0)
-                        RtlCopyMemory(pp, addr, stripe_length);
-                    else
-                        do_xor(pp, addr, stripe_length);
-
                     pos += stripe_length;
                     addr += stripe_length;
 
@@ -1003,85 +978,39 @@ NTSTATUS set_pdo::write_raid6(PIRP Irp, bool* no_complete) {
                 }
             }
         }
+
+        batch.run();
     }
 
     for (unsigned int i = 0; i < array_info.raid_disks; i++) {
         if (ctxs[i].Irp) {
-            ctxs[i].Status = IoCallDriver(child_list[i]->device, ctxs[i].Irp);
-            if (!NT_SUCCESS(ctxs[i].Status))
-                ERR("IoCallDriver returned %08x\n", ctxs[i].Status);
+            Status = parent->call(ctxs[i]);
+            if (!NT_SUCCESS(Status))
+                ERR("IoCallDriver returned %08x\n", Status);
         }
     }
 
     if (skip_first != 0) {
-        first_bit.Status = IoCallDriver(first_bit.sc->device, first_bit.Irp);
-        if (!NT_SUCCESS(first_bit.Status))
-            ERR("IoCallDriver returned %08x\n", first_bit.Status);
-    }
-
-    Status = STATUS_SUCCESS;
-
-    for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-        if (ctxs[i].Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&ctxs[i].Event, Executive, KernelMode, false, nullptr);
-            ctxs[i].Status = ctxs[i].iosb.Status;
-        }
-
-        if (!NT_SUCCESS(ctxs[i].Status))
-            Status = ctxs[i].Status;
-    }
-
-    if (skip_first != 0) {
-        if (first_bit.Status == STATUS_PENDING) {
-            KeWaitForSingleObject(&first_bit.Event, Executive, KernelMode, false, nullptr);
-            first_bit.Status = first_bit.iosb.Status;
-        }
-
-        if (!NT_SUCCESS(first_bit.Status))
-            Status = first_bit.Status;
+        Status = parent->call(first_bit);
+        if (!NT_SUCCESS(Status))
+            ERR("IoCallDriver returned %08x\n", Status);
     }
 
 #ifdef DEBUG_PARANOID
+    Status = parent->wait();
+
     if (parity_length != 0)
         paranoid_raid6_check(parity_offset, parity_length);
-#endif
-
-end:
-    if (!mdl_locked)
-        MmUnlockPages(Irp->MdlAddress);
-
-    if (parity_mdl)
-        IoFreeMdl(parity_mdl);
-
-    if (q_mdl)
-        IoFreeMdl(q_mdl);
-
-    if (parity_data)
-        ExFreePool(parity_data);
 
-    if (q_data)
-        ExFreePool(q_data);
+    delete parent;
 
-    if (ctxs) {
-        for (unsigned int i = 0; i < array_info.raid_disks; i++) {
-            if (ctxs[i].mdl)
-                IoFreeMdl(ctxs[i].mdl);
-
-            if (ctxs[i].va)
-                ExFreePool(ctxs[i].va);
-
-            if (ctxs[i].Irp)
-                IoFreeIrp(ctxs[i].Irp);
-        }
-
-        ExFreePool(ctxs);
-    }
-
-    if (tmpmdl)
-        IoFreeMdl(tmpmdl);
+    return Status;
+#else
+    return parent->pend(no_complete);
+#endif
 
-    if (tmpbuf)
-        ExFreePool(tmpbuf);
+end:
+    delete parent;
 
     return Status;
 }
@@ -1097,7 +1026,13 @@ NTSTATUS set_pdo::flush_partial_chunk_raid6(partial_chunk* pc, RTL_BITMAP* valid
     auto q_dev = child_list[q_num];
     uint32_t data_disks = array_info.raid_disks - 2;
     uint32_t chunk_size = array_info.chunksize * 512;
-    bool asymmetric = array_info.layout == RAID_LAYOUT_LEFT_ASYMMETRIC || array_info.layout == RAID_LAYOUT_RIGHT_ASYMMETRIC;
+
+    np_buffer p(chunk_size);
+
+    if (!p.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     np_buffer q(chunk_size);
 
@@ -1106,37 +1041,25 @@ NTSTATUS set_pdo::flush_partial_chunk_raid6(partial_chunk* pc, RTL_BITMAP* valid
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    while (runlength != 0) {
-        if (asymmetric && q_num != 0 && q_num != 1 && q_num != array_info.raid_disks - 1) {
-            uint32_t stripe = (parity + array_info.raid_disks - 1) % array_info.raid_disks;
+    np_buffer syndrome_buf(sizeof(uint8_t*) * data_disks);
 
-            RtlCopyMemory(q.buf + (index * 512), pc->data + (stripe * chunk_size) + (index * 512), runlength * 512);
+    if (!syndrome_buf.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-            for (uint32_t i = 1; i < data_disks; i++) {
-                stripe = (stripe + array_info.raid_disks - 3) % (array_info.raid_disks - 2);
+    auto syndrome_data = (uint8_t**)syndrome_buf.buf;
+    parity_batch batch(chunk_size);
 
-                galois_double(q.buf + (index * 512), runlength * 512);
-                do_xor(q.buf + (index * 512), pc->data + (stripe * chunk_size) + (index * 512), runlength * 512);
-            }
-        } else {
-            for (uint32_t i = 0; i < data_disks; i++) {
-                if (i == 0)
-                    RtlCopyMemory(q.buf + (index * 512), pc->data + ((data_disks - 1) * chunk_size) + (index * 512), runlength * 512);
-                else {
-                    galois_double(q.buf + (index * 512), runlength * 512);
-                    do_xor(q.buf + (index * 512), pc->data + ((data_disks - i - 1) * chunk_size) + (index * 512), runlength * 512);
-                }
-            }
-        }
+    get_syndrome_order(parity, pc->data, chunk_size, syndrome_data);
 
-        for (uint32_t i = 1; i < data_disks; i++) {
-            do_xor(pc->data + (index * 512), pc->data + (i * chunk_size) + (index * 512), runlength * 512);
-        }
+    while (runlength != 0) {
+        batch.add(data_disks, index * pc_block, (index + runlength) * pc_block, syndrome_data, p.buf, q.buf);
 
         {
-            uint64_t stripe_start = (pc->offset / data_disks) + (index * 512) + (parity_dev->disk_info.data_offset * 512);
+            uint64_t stripe_start = (pc->offset / data_disks) + (index * pc_block) + (parity_dev->disk_info.data_offset * 512);
 
-            ctxs.emplace_back_np(parity_dev, stripe_start, stripe_start + (runlength * 512));
+            ctxs.emplace_back_np(parity_dev, stripe_start, stripe_start + (runlength * pc_block), &pool);
 
             auto last = &ctxs.back();
 
@@ -1145,13 +1068,13 @@ NTSTATUS set_pdo::flush_partial_chunk_raid6(partial_chunk* pc, RTL_BITMAP* valid
                 return last->Status;
             }
 
-            last->va2 = pc->data + (index * 512);
+            last->va2 = p.buf + (index * pc_block);
         }
 
         {
-            uint64_t stripe_start = (pc->offset / data_disks) + (index * 512) + (q_dev->disk_info.data_offset * 512);
+            uint64_t stripe_start = (pc->offset / data_disks) + (index * pc_block) + (q_dev->disk_info.data_offset * 512);
 
-            ctxs.emplace_back_np(q_dev, stripe_start, stripe_start + (runlength * 512));
+            ctxs.emplace_back_np(q_dev, stripe_start, stripe_start + (runlength * pc_block), &pool);
 
             auto last = &ctxs.back();
 
@@ -1160,12 +1083,19 @@ NTSTATUS set_pdo::flush_partial_chunk_raid6(partial_chunk* pc, RTL_BITMAP* valid
                 return last->Status;
             }
 
-            last->va2 = q.buf + (index * 512);
+            last->va2 = q.buf + (index * pc_block);
         }
 
         runlength = RtlFindNextForwardRunClear(valid_bmp, index + runlength, &index);
     }
 
+    batch.run();
+
+    // the new data goes to disk at the same time as the parity
+    Status = add_block_ctxs(ctxs, pc, 0, chunk_size * data_disks, true, pc->data);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
     if (!ctxs.empty()) {
         LIST_ENTRY* le = ctxs.list.Flink;
         while (le != &ctxs.list) {
@@ -1188,32 +1118,122 @@ NTSTATUS set_pdo::flush_partial_chunk_raid6(partial_chunk* pc, RTL_BITMAP* valid
             IrpSp->Parameters.Write.ByteOffset.QuadPart = ctx.stripe_start;
             IrpSp->Parameters.Write.Length = (ULONG)(ctx.stripe_end - ctx.stripe_start);
 
-            ctx.Status = IoCallDriver(ctx.sc->device, ctx.Irp);
-
             le = le->Flink;
         }
 
-        Status = STATUS_SUCCESS;
+        io_parent parent(nullptr);
 
         le = ctxs.list.Flink;
         while (le != &ctxs.list) {
-            auto& ctx = ctxs.entry(le);
-
-            if (ctx.Status == STATUS_PENDING) {
-                KeWaitForSingleObject(&ctx.Event, Executive, KernelMode, false, nullptr);
-                ctx.Status = ctx.iosb.Status;
-            }
-
-            if (!NT_SUCCESS(ctx.Status)) {
-                ERR("writing returned %08x\n", ctx.Status);
-                Status = ctx.Status;
-            }
+            parent.call(ctxs.entry(le));
 
             le = le->Flink;
         }
 
-        if (!NT_SUCCESS(Status))
+        Status = parent.wait();
+        if (!NT_SUCCESS(Status)) {
+            ERR("writing returned %08x\n", Status);
             return Status;
+        }
+    }
+
+#ifdef DEBUG_PARANOID
+    paranoid_raid6_check(pc->offset, chunk_size * data_disks);
+#endif
+
+    return STATUS_SUCCESS;
+}
+
+static uint8_t galois_power(uint32_t n) {
+    uint8_t v = 1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        v = (uint8_t)((v << 1) ^ ((v & 0x80) ? 0x1d : 0));
+    }
+
+    return v;
+}
+
+// Read-modify-write: rather than reading the rest of each row, we read the old P and Q,
+// and apply to them the difference between the old and new data, i.e.
+// P' = P ^ dD and Q' = Q ^ g^i.dD, where i is the index of the chunk in the syndrome. The old
+// data is still on disk, as the new data only goes there now, along with the parity.
+NTSTATUS set_pdo::flush_partial_chunk_raid6_rmw(partial_chunk* pc, RTL_BITMAP* valid_bmp) {
+    NTSTATUS Status;
+    klist<io_context> read_ctxs, write_ctxs;
+    ULONG index, runlength;
+    auto parity = get_parity_volume(pc->offset);
+    uint32_t data_disks = array_info.raid_disks - 2;
+    uint32_t chunk_size = array_info.chunksize * 512;
+
+    np_buffer p(chunk_size);
+
+    if (!p.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    np_buffer q(chunk_size);
+
+    if (!q.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    np_buffer old(chunk_size * data_disks);
+
+    if (!old.buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = add_parity_ctxs(read_ctxs, pc, valid_bmp, p.buf, q.buf);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = add_block_ctxs(read_ctxs, pc, 0, chunk_size * data_disks, true, old.buf);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = sync_io(read_ctxs, false);
+    if (!NT_SUCCESS(Status)) {
+        ERR("reading returned %08x\n", Status);
+        return Status;
+    }
+
+    for (uint32_t i = 0; i < data_disks; i++) {
+        uint8_t coeff = galois_power(get_syndrome_index(parity, i));
+        ULONG start = i * pc_rows, end = start + pc_rows;
+
+        // clear bits are the blocks we've written to
+        runlength = RtlFindNextForwardRunClear(&pc->bmp, start, &index);
+
+        while (runlength != 0 && index < end) {
+            runlength = min(runlength, end - index);
+
+            auto delta = old.buf + (index * pc_block);
+            uint32_t col_off = (index - start) * pc_block;
+
+            do_xor(delta, pc->data + (index * pc_block), runlength * pc_block);
+            do_xor(p.buf + col_off, delta, runlength * pc_block);
+            galois_mul_xor(q.buf + col_off, delta, coeff, runlength * pc_block);
+
+            runlength = RtlFindNextForwardRunClear(&pc->bmp, index + runlength, &index);
+        }
+    }
+
+    Status = add_parity_ctxs(write_ctxs, pc, valid_bmp, p.buf, q.buf);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = add_block_ctxs(write_ctxs, pc, 0, chunk_size * data_disks, true, pc->data);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = sync_io(write_ctxs, true);
+    if (!NT_SUCCESS(Status)) {
+        ERR("writing returned %08x\n", Status);
+        return Status;
     }
 
 #ifdef DEBUG_PARANOID
@@ -1233,7 +1253,7 @@ void set_pdo::paranoid_raid6_check(uint64_t parity_offset, uint32_t parity_lengt
     klist<io_context> ctxs;
 
     for (uint32_t i = 0; i < array_info.raid_disks; i++) {
-        ctxs.emplace_back_np(child_list[i], read_offset + (child_list[i]->disk_info.data_offset * 512), parity_length);
+        ctxs.emplace_back_np(child_list[i], read_offset + (child_list[i]->disk_info.data_offset * 512), parity_length, &pool);
         auto& last = ctxs.back();
 
         if (!NT_SUCCESS(last.Status)) {
@@ -0,0 +1,899 @@
+/* Copyright (c) Mark Harmstone 2019
+ *
+ * This file is part of WinMD.
+ *
+ * WinMD is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinMD.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "winmd.h"
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define TARGET(x)
+#else
+#define TARGET(x) __attribute__((target(x)))
+#endif
+
+static void xor_sse2(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    uint32_t j;
+    __m128i x1, x2;
+
+    if (have_sse2 && len >= 16) {
+        // do bytes one at a time until the destination is aligned, then only buf2 needs unaligned loads
+
+        while (((uintptr_t)buf1 & 0xf) != 0) {
+            *buf1 ^= *buf2;
+            buf1++;
+            buf2++;
+            len--;
+        }
+
+        while (len >= 16) {
+            x1 = _mm_load_si128((__m128i*)buf1);
+            x2 = _mm_loadu_si128((__m128i*)buf2);
+            x1 = _mm_xor_si128(x1, x2);
+            _mm_store_si128((__m128i*)buf1, x1);
+
+            buf1 += 16;
+            buf2 += 16;
+            len -= 16;
+        }
+    }
+
+    while (len >= 4) {
+        *(uint32_t*)buf1 ^= *(uint32_t*)buf2;
+        buf1 += 4;
+        buf2 += 4;
+        len -= 4;
+    }
+
+    for (j = 0; j < len; j++) {
+        *buf1 ^= *buf2;
+        buf1++;
+        buf2++;
+    }
+}
+
+TARGET("avx2")
+static void xor_avx2(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    while (len >= 32) {
+        __m256i x1 = _mm256_loadu_si256((__m256i*)buf1);
+        __m256i x2 = _mm256_loadu_si256((__m256i*)buf2);
+        _mm256_storeu_si256((__m256i*)buf1, _mm256_xor_si256(x1, x2));
+
+        buf1 += 32;
+        buf2 += 32;
+        len -= 32;
+    }
+
+    xor_sse2(buf1, buf2, len);
+}
+
+TARGET("avx512f")
+static void xor_avx512(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    while (len >= 64) {
+        __m512i x1 = _mm512_loadu_si512(buf1);
+        __m512i x2 = _mm512_loadu_si512(buf2);
+        _mm512_storeu_si512(buf1, _mm512_xor_si512(x1, x2));
+
+        buf1 += 64;
+        buf2 += 64;
+        len -= 64;
+    }
+
+    xor_sse2(buf1, buf2, len);
+}
+
+static void and_sse2(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    uint32_t j;
+    __m128i x1, x2;
+
+    if (have_sse2 && len >= 16) {
+        // do bytes one at a time until the destination is aligned, then only buf2 needs unaligned loads
+
+        while (((uintptr_t)buf1 & 0xf) != 0) {
+            *buf1 &= *buf2;
+            buf1++;
+            buf2++;
+            len--;
+        }
+
+        while (len >= 16) {
+            x1 = _mm_load_si128((__m128i*)buf1);
+            x2 = _mm_loadu_si128((__m128i*)buf2);
+            x1 = _mm_and_si128(x1, x2);
+            _mm_store_si128((__m128i*)buf1, x1);
+
+            buf1 += 16;
+            buf2 += 16;
+            len -= 16;
+        }
+    }
+
+    while (len >= 4) {
+        *(uint32_t*)buf1 &= *(uint32_t*)buf2;
+        buf1 += 4;
+        buf2 += 4;
+        len -= 4;
+    }
+
+    for (j = 0; j < len; j++) {
+        *buf1 &= *buf2;
+        buf1++;
+        buf2++;
+    }
+}
+
+TARGET("avx2")
+static void and_avx2(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    while (len >= 32) {
+        __m256i x1 = _mm256_loadu_si256((__m256i*)buf1);
+        __m256i x2 = _mm256_loadu_si256((__m256i*)buf2);
+        _mm256_storeu_si256((__m256i*)buf1, _mm256_and_si256(x1, x2));
+
+        buf1 += 32;
+        buf2 += 32;
+        len -= 32;
+    }
+
+    and_sse2(buf1, buf2, len);
+}
+
+TARGET("avx512f")
+static void and_avx512(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    while (len >= 64) {
+        __m512i x1 = _mm512_loadu_si512(buf1);
+        __m512i x2 = _mm512_loadu_si512(buf2);
+        _mm512_storeu_si512(buf1, _mm512_and_si512(x1, x2));
+
+        buf1 += 64;
+        buf2 += 64;
+        len -= 64;
+    }
+
+    and_sse2(buf1, buf2, len);
+}
+
+// The code from the following functions is derived from the paper
+// "The mathematics of RAID-6", by H. Peter Anvin.
+// https://www.kernel.org/pub/linux/kernel/people/hpa/raid6.pdf
+
+#ifdef _AMD64_
+__inline static uint64_t galois_double_mask64(uint64_t v) {
+    v &= 0x8080808080808080;
+    return (v << 1) - (v >> 7);
+}
+#else
+__inline static uint32_t galois_double_mask32(uint32_t v) {
+    v &= 0x80808080;
+    return (v << 1) - (v >> 7);
+}
+#endif
+
+static void galois_double_scalar(uint8_t* data, uint32_t len) {
+#ifdef _AMD64_
+    while (len > sizeof(uint64_t)) {
+        uint64_t v = *((uint64_t*)data), vv;
+
+        vv = (v << 1) & 0xfefefefefefefefe;
+        vv ^= galois_double_mask64(v) & 0x1d1d1d1d1d1d1d1d;
+        *((uint64_t*)data) = vv;
+
+        data += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+#else
+    while (len > sizeof(uint32_t)) {
+        uint32_t v = *((uint32_t*)data), vv;
+
+        vv = (v << 1) & 0xfefefefe;
+        vv ^= galois_double_mask32(v) & 0x1d1d1d1d;
+        *((uint32_t*)data) = vv;
+
+        data += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+#endif
+
+    while (len > 0) {
+        data[0] = (data[0] << 1) ^ ((data[0] & 0x80) ? 0x1d : 0);
+        data++;
+        len--;
+    }
+}
+
+// In the vector versions, the comparison against zero gives us 0xff for each byte
+// with its top bit set, i.e. the ones which need reducing by the polynomial.
+
+static void galois_double_sse2(uint8_t* data, uint32_t len) {
+    if (have_sse2 && len >= 16) {
+        __m128i poly = _mm_set1_epi8(0x1d);
+        __m128i zero = _mm_setzero_si128();
+        uint32_t head = (uint32_t)((16 - ((uintptr_t)data & 0xf)) & 0xf);
+
+        if (head != 0) {
+            galois_double_scalar(data, head);
+            data += head;
+            len -= head;
+        }
+
+        while (len >= 16) {
+            __m128i v = _mm_load_si128((__m128i*)data);
+            __m128i mask = _mm_cmpgt_epi8(zero, v);
+
+            v = _mm_add_epi8(v, v);
+            v = _mm_xor_si128(v, _mm_and_si128(mask, poly));
+            _mm_store_si128((__m128i*)data, v);
+
+            data += 16;
+            len -= 16;
+        }
+    }
+
+    galois_double_scalar(data, len);
+}
+
+TARGET("avx2")
+static void galois_double_avx2(uint8_t* data, uint32_t len) {
+    __m256i poly = _mm256_set1_epi8(0x1d);
+    __m256i zero = _mm256_setzero_si256();
+
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)data);
+        __m256i mask = _mm256_cmpgt_epi8(zero, v);
+
+        v = _mm256_add_epi8(v, v);
+        v = _mm256_xor_si256(v, _mm256_and_si256(mask, poly));
+        _mm256_storeu_si256((__m256i*)data, v);
+
+        data += 32;
+        len -= 32;
+    }
+
+    galois_double_sse2(data, len);
+}
+
+TARGET("avx512f,avx512bw")
+static void galois_double_avx512(uint8_t* data, uint32_t len) {
+    __m512i poly = _mm512_set1_epi8(0x1d);
+
+    while (len >= 64) {
+        __m512i v = _mm512_loadu_si512(data);
+        __mmask64 mask = _mm512_movepi8_mask(v);
+
+        v = _mm512_add_epi8(v, v);
+        v = _mm512_xor_si512(v, _mm512_maskz_mov_epi8(mask, poly));
+        _mm512_storeu_si512(data, v);
+
+        data += 64;
+        len -= 64;
+    }
+
+    galois_double_sse2(data, len);
+}
+
+// The syndrome functions read each data block once and build P and Q together,
+// using Horner's method for Q, as Linux does. data[i] gets the coefficient g^i. Like the
+// xor_blocks functions, they work on the bytes from off up to end of each buffer.
+
+static void gen_syndrome_scalar(uint32_t num, uint32_t off, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q) {
+#ifdef _AMD64_
+    for (; off + sizeof(uint64_t) <= end; off += sizeof(uint64_t)) {
+        uint64_t wp = *(uint64_t*)(data[num - 1] + off);
+        uint64_t wq = wp;
+
+        for (uint32_t i = num - 1; i > 0; i--) {
+            uint64_t d = *(uint64_t*)(data[i - 1] + off);
+
+            wq = ((wq << 1) & 0xfefefefefefefefe) ^ (galois_double_mask64(wq) & 0x1d1d1d1d1d1d1d1d);
+            wq ^= d;
+            wp ^= d;
+        }
+
+        *(uint64_t*)(p + off) = wp;
+        *(uint64_t*)(q + off) = wq;
+    }
+#else
+    for (; off + sizeof(uint32_t) <= end; off += sizeof(uint32_t)) {
+        uint32_t wp = *(uint32_t*)(data[num - 1] + off);
+        uint32_t wq = wp;
+
+        for (uint32_t i = num - 1; i > 0; i--) {
+            uint32_t d = *(uint32_t*)(data[i - 1] + off);
+
+            wq = ((wq << 1) & 0xfefefefe) ^ (galois_double_mask32(wq) & 0x1d1d1d1d);
+            wq ^= d;
+            wp ^= d;
+        }
+
+        *(uint32_t*)(p + off) = wp;
+        *(uint32_t*)(q + off) = wq;
+    }
+#endif
+
+    for (; off < end; off++) {
+        uint8_t wp = data[num - 1][off];
+        uint8_t wq = wp;
+
+        for (uint32_t i = num - 1; i > 0; i--) {
+            uint8_t d = data[i - 1][off];
+
+            wq = (uint8_t)((wq << 1) ^ ((wq & 0x80) ? 0x1d : 0)) ^ d;
+            wp ^= d;
+        }
+
+        p[off] = wp;
+        q[off] = wq;
+    }
+}
+
+static void gen_syndrome_sse2(uint32_t num, uint32_t off, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q) {
+    if (have_sse2) {
+        __m128i poly = _mm_set1_epi8(0x1d);
+        __m128i zero = _mm_setzero_si128();
+
+        for (; off + 16 <= end; off += 16) {
+            __m128i wp = _mm_loadu_si128((__m128i*)(data[num - 1] + off));
+            __m128i wq = wp;
+
+            for (uint32_t i = num - 1; i > 0; i--) {
+                __m128i d = _mm_loadu_si128((__m128i*)(data[i - 1] + off));
+                __m128i mask = _mm_cmpgt_epi8(zero, wq);
+
+                wq = _mm_add_epi8(wq, wq);
+                wq = _mm_xor_si128(wq, _mm_and_si128(mask, poly));
+                wq = _mm_xor_si128(wq, d);
+                wp = _mm_xor_si128(wp, d);
+            }
+
+            _mm_storeu_si128((__m128i*)(p + off), wp);
+            _mm_storeu_si128((__m128i*)(q + off), wq);
+        }
+    }
+
+    gen_syndrome_scalar(num, off, end, data, p, q);
+}
+
+TARGET("avx2")
+static void gen_syndrome_avx2(uint32_t num, uint32_t off, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q) {
+    __m256i poly = _mm256_set1_epi8(0x1d);
+    __m256i zero = _mm256_setzero_si256();
+
+    for (; off + 32 <= end; off += 32) {
+        __m256i wp = _mm256_loadu_si256((__m256i*)(data[num - 1] + off));
+        __m256i wq = wp;
+
+        for (uint32_t i = num - 1; i > 0; i--) {
+            __m256i d = _mm256_loadu_si256((__m256i*)(data[i - 1] + off));
+            __m256i mask = _mm256_cmpgt_epi8(zero, wq);
+
+            wq = _mm256_add_epi8(wq, wq);
+            wq = _mm256_xor_si256(wq, _mm256_and_si256(mask, poly));
+            wq = _mm256_xor_si256(wq, d);
+            wp = _mm256_xor_si256(wp, d);
+        }
+
+        _mm256_storeu_si256((__m256i*)(p + off), wp);
+        _mm256_storeu_si256((__m256i*)(q + off), wq);
+    }
+
+    gen_syndrome_sse2(num, off, end, data, p, q);
+}
+
+TARGET("avx512f,avx512bw")
+static void gen_syndrome_avx512(uint32_t num, uint32_t off, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q) {
+    __m512i poly = _mm512_set1_epi8(0x1d);
+
+    for (; off + 64 <= end; off += 64) {
+        __m512i wp = _mm512_loadu_si512(data[num - 1] + off);
+        __m512i wq = wp;
+
+        for (uint32_t i = num - 1; i > 0; i--) {
+            __m512i d = _mm512_loadu_si512(data[i - 1] + off);
+            __mmask64 mask = _mm512_movepi8_mask(wq);
+
+            wq = _mm512_add_epi8(wq, wq);
+            wq = _mm512_xor_si512(wq, _mm512_maskz_mov_epi8(mask, poly));
+            wq = _mm512_xor_si512(wq, d);
+            wp = _mm512_xor_si512(wp, d);
+        }
+
+        _mm512_storeu_si512(p + off, wp);
+        _mm512_storeu_si512(q + off, wq);
+    }
+
+    gen_syndrome_sse2(num, off, end, data, p, q);
+}
+
+// The xor_blocks functions XOR num sources together into dest in one pass, rather
+// than loading and storing dest once per source. dest may be one of the sources.
+
+static void xor_blocks_scalar(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* dest) {
+#ifdef _AMD64_
+    for (; off + sizeof(uint64_t) <= end; off += sizeof(uint64_t)) {
+        uint64_t v = *(uint64_t*)(srcs[0] + off);
+
+        for (uint32_t i = 1; i < num; i++) {
+            v ^= *(uint64_t*)(srcs[i] + off);
+        }
+
+        *(uint64_t*)(dest + off) = v;
+    }
+#else
+    for (; off + sizeof(uint32_t) <= end; off += sizeof(uint32_t)) {
+        uint32_t v = *(uint32_t*)(srcs[0] + off);
+
+        for (uint32_t i = 1; i < num; i++) {
+            v ^= *(uint32_t*)(srcs[i] + off);
+        }
+
+        *(uint32_t*)(dest + off) = v;
+    }
+#endif
+
+    for (; off < end; off++) {
+        uint8_t v = srcs[0][off];
+
+        for (uint32_t i = 1; i < num; i++) {
+            v ^= srcs[i][off];
+        }
+
+        dest[off] = v;
+    }
+}
+
+static void xor_blocks_sse2(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* dest) {
+    if (have_sse2) {
+        for (; off + 16 <= end; off += 16) {
+            __m128i v = _mm_loadu_si128((__m128i*)(srcs[0] + off));
+
+            for (uint32_t i = 1; i < num; i++) {
+                v = _mm_xor_si128(v, _mm_loadu_si128((__m128i*)(srcs[i] + off)));
+            }
+
+            _mm_storeu_si128((__m128i*)(dest + off), v);
+        }
+    }
+
+    xor_blocks_scalar(num, off, end, srcs, dest);
+}
+
+TARGET("avx2")
+static void xor_blocks_avx2(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* dest) {
+    for (; off + 32 <= end; off += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(srcs[0] + off));
+
+        for (uint32_t i = 1; i < num; i++) {
+            v = _mm256_xor_si256(v, _mm256_loadu_si256((__m256i*)(srcs[i] + off)));
+        }
+
+        _mm256_storeu_si256((__m256i*)(dest + off), v);
+    }
+
+    xor_blocks_sse2(num, off, end, srcs, dest);
+}
+
+TARGET("avx512f")
+static void xor_blocks_avx512(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* dest) {
+    for (; off + 64 <= end; off += 64) {
+        __m512i v = _mm512_loadu_si512(srcs[0] + off);
+
+        for (uint32_t i = 1; i < num; i++) {
+            v = _mm512_xor_si512(v, _mm512_loadu_si512(srcs[i] + off));
+        }
+
+        _mm512_storeu_si512(dest + off, v);
+    }
+
+    xor_blocks_sse2(num, off, end, srcs, dest);
+}
+
+// The galois_mul_xor functions do dest ^= c * src, which is what we need to apply
+// a change in one data chunk to Q without reading the others.
+
+static uint8_t galois_mul(uint8_t a, uint8_t b) {
+    uint8_t r = 0;
+
+    while (b != 0) {
+        if (b & 1)
+            r ^= a;
+
+        a = (uint8_t)((a << 1) ^ ((a & 0x80) ? 0x1d : 0));
+        b >>= 1;
+    }
+
+    return r;
+}
+
+static void galois_mul_xor_scalar(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len) {
+    uint8_t tbl[256];
+
+    for (unsigned int i = 0; i < 256; i++) {
+        tbl[i] = galois_mul((uint8_t)i, c);
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        dest[i] ^= tbl[src[i]];
+    }
+}
+
+// SSE2 has no byte shuffle, so we do shift-and-add multiplication, doubling src for each bit of c
+static void galois_mul_xor_sse2(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len) {
+    if (have_sse2) {
+        __m128i poly = _mm_set1_epi8(0x1d);
+        __m128i zero = _mm_setzero_si128();
+
+        while (len >= 16) {
+            __m128i v = _mm_loadu_si128((__m128i*)src);
+            __m128i r = _mm_loadu_si128((__m128i*)dest);
+
+            for (uint8_t b = c; b != 0; b >>= 1) {
+                if (b & 1)
+                    r = _mm_xor_si128(r, v);
+
+                __m128i mask = _mm_cmpgt_epi8(zero, v);
+
+                v = _mm_add_epi8(v, v);
+                v = _mm_xor_si128(v, _mm_and_si128(mask, poly));
+            }
+
+            _mm_storeu_si128((__m128i*)dest, r);
+
+            dest += 16;
+            src += 16;
+            len -= 16;
+        }
+    }
+
+    if (len > 0)
+        galois_mul_xor_scalar(dest, src, c, len);
+}
+
+// With a byte shuffle we can look up c * x as c * (low nibble) ^ c * (high nibble << 4)
+
+static void galois_mul_tables(uint8_t c, uint8_t* lo, uint8_t* hi) {
+    for (unsigned int i = 0; i < 16; i++) {
+        lo[i] = galois_mul((uint8_t)i, c);
+        hi[i] = galois_mul((uint8_t)(i << 4), c);
+    }
+}
+
+TARGET("avx2")
+static void galois_mul_xor_avx2(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len) {
+    uint8_t lo[16], hi[16];
+
+    galois_mul_tables(c, lo, hi);
+
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)hi));
+    __m256i nibble = _mm256_set1_epi8(0xf);
+
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)src);
+        __m256i r = _mm256_shuffle_epi8(tlo, _mm256_and_si256(v, nibble));
+
+        r = _mm256_xor_si256(r, _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+        r = _mm256_xor_si256(r, _mm256_loadu_si256((__m256i*)dest));
+        _mm256_storeu_si256((__m256i*)dest, r);
+
+        dest += 32;
+        src += 32;
+        len -= 32;
+    }
+
+    galois_mul_xor_sse2(dest, src, c, len);
+}
+
+TARGET("avx512f,avx512bw")
+static void galois_mul_xor_avx512(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len) {
+    uint8_t lo[16], hi[16];
+
+    galois_mul_tables(c, lo, hi);
+
+    __m512i tlo = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i*)lo));
+    __m512i thi = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i*)hi));
+    __m512i nibble = _mm512_set1_epi8(0xf);
+
+    while (len >= 64) {
+        __m512i v = _mm512_loadu_si512(src);
+        __m512i r = _mm512_shuffle_epi8(tlo, _mm512_and_si512(v, nibble));
+
+        r = _mm512_xor_si512(r, _mm512_shuffle_epi8(thi, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble)));
+        r = _mm512_xor_si512(r, _mm512_loadu_si512(dest));
+        _mm512_storeu_si512(dest, r);
+
+        dest += 64;
+        src += 64;
+        len -= 64;
+    }
+
+    galois_mul_xor_sse2(dest, src, c, len);
+}
+
+static const simd_funcs simd_sse2 = { xor_sse2, and_sse2, galois_double_sse2, gen_syndrome_sse2, xor_blocks_sse2, galois_mul_xor_sse2, 0 };
+static const simd_funcs simd_avx2 = { xor_avx2, and_avx2, galois_double_avx2, gen_syndrome_avx2, xor_blocks_avx2, galois_mul_xor_avx2,
+                                      XSTATE_MASK_AVX };
+static const simd_funcs simd_avx512 = { xor_avx512, and_avx512, galois_double_avx512, gen_syndrome_avx512, xor_blocks_avx512, galois_mul_xor_avx512,
+                                        XSTATE_MASK_AVX | XSTATE_MASK_AVX512 };
+
+simd_funcs simd = simd_sse2;
+
+void init_simd() {
+    if (have_avx512f) {
+        simd.xor_func = xor_avx512;
+        simd.and_func = and_avx512;
+        simd.xor_blocks_func = xor_blocks_avx512;
+        simd.xstate_mask = XSTATE_MASK_AVX | XSTATE_MASK_AVX512;
+    } else if (have_avx2) {
+        simd.xor_func = xor_avx2;
+        simd.and_func = and_avx2;
+        simd.xor_blocks_func = xor_blocks_avx2;
+        simd.xstate_mask = XSTATE_MASK_AVX;
+    }
+
+    if (have_avx512bw) {
+        simd.galois_double_func = galois_double_avx512;
+        simd.gen_syndrome_func = gen_syndrome_avx512;
+        simd.galois_mul_xor_func = galois_mul_xor_avx512;
+        simd.xstate_mask = XSTATE_MASK_AVX | XSTATE_MASK_AVX512;
+    } else if (have_avx2) {
+        simd.galois_double_func = galois_double_avx2;
+        simd.gen_syndrome_func = gen_syndrome_avx2;
+        simd.galois_mul_xor_func = galois_mul_xor_avx2;
+    }
+}
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_DATA_BLOCKS 8
+#define BENCH_ITERATIONS 256
+
+static const struct {
+    const WCHAR* name;
+    const simd_funcs* funcs;
+} simd_impls[] = {
+    { L"sse2", &simd_sse2 },
+    { L"avx2", &simd_avx2 },
+    { L"avx512", &simd_avx512 },
+};
+
+static const WCHAR* simd_op_names[SIMD_OPS] = { L"Xor", L"And", L"GaloisDouble", L"GenSyndrome", L"XorBlocks", L"GaloisMulXor" };
+
+simd_result simd_results[SIMD_OPS];
+
+static bool simd_impl_available(unsigned int impl, unsigned int op) {
+    switch (impl) {
+        case 0:
+            return true;
+
+        case 1:
+            return have_avx2;
+
+        case 2:
+            if (op == SIMD_OP_GALOIS_DOUBLE || op == SIMD_OP_GEN_SYNDROME || op == SIMD_OP_GALOIS_MUL_XOR)
+                return have_avx512bw;
+            else
+                return have_avx512f;
+    }
+
+    return false;
+}
+
+// returns the number of bytes of data read
+static uint32_t simd_run_op(const simd_funcs& funcs, unsigned int op, uint8_t* buf) {
+    uint8_t* data[BENCH_DATA_BLOCKS];
+    uint8_t* p = buf + (BENCH_DATA_BLOCKS * BENCH_BLOCK_SIZE);
+    uint8_t* q = p + BENCH_BLOCK_SIZE;
+
+    for (unsigned int i = 0; i < BENCH_DATA_BLOCKS; i++) {
+        data[i] = buf + (i * BENCH_BLOCK_SIZE);
+    }
+
+    switch (op) {
+        case SIMD_OP_XOR:
+            funcs.xor_func(p, data[0], BENCH_BLOCK_SIZE);
+            return BENCH_BLOCK_SIZE;
+
+        case SIMD_OP_AND:
+            funcs.and_func(p, data[0], BENCH_BLOCK_SIZE);
+            return BENCH_BLOCK_SIZE;
+
+        case SIMD_OP_GALOIS_DOUBLE:
+            funcs.galois_double_func(q, BENCH_BLOCK_SIZE);
+            return BENCH_BLOCK_SIZE;
+
+        case SIMD_OP_GEN_SYNDROME:
+            funcs.gen_syndrome_func(BENCH_DATA_BLOCKS, 0, BENCH_BLOCK_SIZE, data, p, q);
+            return BENCH_DATA_BLOCKS * BENCH_BLOCK_SIZE;
+
+        case SIMD_OP_XOR_BLOCKS:
+            funcs.xor_blocks_func(BENCH_DATA_BLOCKS, 0, BENCH_BLOCK_SIZE, data, p);
+            return BENCH_DATA_BLOCKS * BENCH_BLOCK_SIZE;
+
+        case SIMD_OP_GALOIS_MUL_XOR:
+            funcs.galois_mul_xor_func(q, data[0], 0x8e, BENCH_BLOCK_SIZE);
+            return BENCH_BLOCK_SIZE;
+    }
+
+    return 0;
+}
+
+static void simd_set_op(const simd_funcs& funcs, unsigned int op) {
+    switch (op) {
+        case SIMD_OP_XOR:
+            simd.xor_func = funcs.xor_func;
+            break;
+
+        case SIMD_OP_AND:
+            simd.and_func = funcs.and_func;
+            break;
+
+        case SIMD_OP_GALOIS_DOUBLE:
+            simd.galois_double_func = funcs.galois_double_func;
+            break;
+
+        case SIMD_OP_GEN_SYNDROME:
+            simd.gen_syndrome_func = funcs.gen_syndrome_func;
+            break;
+
+        case SIMD_OP_XOR_BLOCKS:
+            simd.xor_blocks_func = funcs.xor_blocks_func;
+            break;
+
+        case SIMD_OP_GALOIS_MUL_XOR:
+            simd.galois_mul_xor_func = funcs.galois_mul_xor_func;
+            break;
+    }
+
+    simd.xstate_mask |= funcs.xstate_mask;
+}
+
+// Like Linux's md, we time each variant on a scratch buffer when we're loaded, rather than
+// assuming the widest vectors are always the fastest - on some CPUs the clock drops when
+// the AVX-512 units are busy. We run at DISPATCH_LEVEL so we don't get rescheduled mid-run.
+// Returns speed in MB/s, or 0 if the variant couldn't be run.
+static uint32_t simd_time_op(const simd_funcs& funcs, unsigned int op, uint8_t* buf) {
+    XSTATE_SAVE save;
+    LARGE_INTEGER freq, start, end;
+    uint64_t bytes = 0;
+    KIRQL irql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    if (funcs.xstate_mask != 0 && !NT_SUCCESS(KeSaveExtendedProcessorState(funcs.xstate_mask, &save))) {
+        KeLowerIrql(irql);
+        return 0;
+    }
+
+    simd_run_op(funcs, op, buf); // warm the cache
+
+    start = KeQueryPerformanceCounter(&freq);
+
+    for (unsigned int i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes += simd_run_op(funcs, op, buf);
+    }
+
+    end = KeQueryPerformanceCounter(nullptr);
+
+    if (funcs.xstate_mask != 0)
+        KeRestoreExtendedProcessorState(&save);
+
+    KeLowerIrql(irql);
+
+    if (end.QuadPart <= start.QuadPart)
+        return 0xffffffff;
+
+    return (uint32_t)min((bytes * freq.QuadPart) / ((end.QuadPart - start.QuadPart) * 1048576), (uint64_t)0xffffffff);
+}
+
+void benchmark_simd() {
+    uint32_t len = (BENCH_DATA_BLOCKS + 2) * BENCH_BLOCK_SIZE;
+
+    auto buf = (uint8_t*)ExAllocatePoolWithTag(NonPagedPool, len, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    // galois_double only gets a non-trivial workout if its input isn't all zeroes
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)((i * 0x9b) ^ (i >> 8));
+    }
+
+    simd.xstate_mask = 0;
+
+    for (unsigned int op = 0; op < SIMD_OPS; op++) {
+        unsigned int best = 0;
+        uint32_t best_speed = 0;
+
+        for (unsigned int impl = 0; impl < sizeof(simd_impls) / sizeof(simd_impls[0]); impl++) {
+            if (!simd_impl_available(impl, op))
+                continue;
+
+            auto speed = simd_time_op(*simd_impls[impl].funcs, op, buf);
+
+            TRACE("%S/%S: %u MB/s\n", simd_op_names[op], simd_impls[impl].name, speed);
+
+            if (speed > best_speed) {
+                best = impl;
+                best_speed = speed;
+            }
+        }
+
+        simd_set_op(*simd_impls[best].funcs, op);
+
+        simd_results[op].op = simd_op_names[op];
+        simd_results[op].impl = simd_impls[best].name;
+        simd_results[op].speed = best_speed;
+    }
+
+    ExFreePool(buf);
+}
+
+// Kernel code has to save the extended state before it touches the YMM or ZMM
+// registers. If we can't, we fall back to SSE2, which doesn't need it.
+class simd_state {
+public:
+    simd_state() {
+        if (simd.xstate_mask != 0)
+            saved = NT_SUCCESS(KeSaveExtendedProcessorState(simd.xstate_mask, &save));
+    }
+
+    ~simd_state() {
+        if (saved)
+            KeRestoreExtendedProcessorState(&save);
+    }
+
+    const simd_funcs& funcs() const {
+        return saved ? simd : simd_sse2;
+    }
+
+private:
+    XSTATE_SAVE save;
+    bool saved = false;
+};
+
+void do_xor(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    simd_state state;
+
+    state.funcs().xor_func(buf1, buf2, len);
+}
+
+void do_and(uint8_t* buf1, uint8_t* buf2, uint32_t len) {
+    simd_state state;
+
+    state.funcs().and_func(buf1, buf2, len);
+}
+
+void galois_double(uint8_t* data, uint32_t len) {
+    simd_state state;
+
+    state.funcs().galois_double_func(data, len);
+}
+
+void gen_syndrome(uint32_t num, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q, uint32_t off) {
+    simd_state state;
+
+    state.funcs().gen_syndrome_func(num, off, end, data, p, q);
+}
+
+void xor_blocks(uint32_t num, uint32_t end, uint8_t** srcs, uint8_t* dest, uint32_t off) {
+    simd_state state;
+
+    state.funcs().xor_blocks_func(num, off, end, srcs, dest);
+}
+
+void galois_mul_xor(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len) {
+    simd_state state;
+
+    state.funcs().galois_mul_xor_func(dest, src, c, len);
+}
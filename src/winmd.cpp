@@ -42,9 +42,14 @@ void *notification_entry = nullptr, *notification_entry2 = nullptr, *notificatio
 PDRIVER_OBJECT drvobj = nullptr;
 PDEVICE_OBJECT master_devobj = nullptr;
 bool have_sse2 = false;
+bool have_avx2 = false;
+bool have_avx512f = false;
+bool have_avx512bw = false;
 #ifdef _DEBUG
 uint32_t debug_log_level = 0;
 #endif
+static HANDLE low_memory_handle;
+static UNICODE_STRING registry_path;
 
 ERESOURCE dev_lock;
 LIST_ENTRY dev_list;
@@ -225,18 +230,41 @@ set_pdo::set_pdo() {
 
     InitializeListHead(&children);
 
-    ExInitializeResourceLite(&partial_chunks_lock);
+    KeInitializeSpinLock(&partial_chunks_lock);
 
     InitializeListHead(&partial_chunks);
 
+    KeInitializeSpinLock(&stripe_locks_lock);
+    InitializeListHead(&stripe_locks);
+    KeInitializeEvent(&stripe_unlocked, NotificationEvent, false);
+
+    for (unsigned int i = 0; i < PARTIAL_CHUNK_BUCKETS; i++) {
+        KeInitializeSpinLock(&partial_chunk_hash[i].lock);
+        InitializeListHead(&partial_chunk_hash[i].list);
+    }
+
     child_list = nullptr;
     bus_name.Buffer = nullptr;
 
+    KeInitializeEvent(&flush_thread_wake, SynchronizationEvent, false);
+    KeInitializeTimerEx(&gather_timer, SynchronizationTimer);
+    KeInitializeSpinLock(&gather_lock);
+    InitializeListHead(&gathers);
+    InitializeListHead(&ready_gathers);
+    KeInitializeSpinLock(&read_ahead_lock);
+    InitializeListHead(&read_ahead);
+    KeInitializeSpinLock(&write_behind_lock);
+    InitializeListHead(&write_behind_queue);
+    InitializeListHead(&write_behind_active);
+    KeInitializeEvent(&write_behind_idle, NotificationEvent, true);
     KeInitializeEvent(&flush_thread_finished, NotificationEvent, false);
+    ExInitializeRundownProtection(&io_rundown);
 }
 
 // FIXME - make sure this gets called
 set_pdo::~set_pdo() {
+    ExWaitForRundownProtectionRelease(&io_rundown);
+
     if (child_list)
         ExFreePool(child_list);
 
@@ -252,8 +280,9 @@ set_pdo::~set_pdo() {
 
     // FIXME - make sure partial chunks list is empty
 
+    invalidate_read_ahead(0, array_size);
+
     ExDeleteResourceLite(&lock);
-    ExDeleteResourceLite(&partial_chunks_lock);
 }
 
 set_child::set_child(PDEVICE_OBJECT device, PFILE_OBJECT fileobj, PUNICODE_STRING devpath, mdraid_disk_info* disk_info) : device(device), fileobj(fileobj) {
@@ -358,8 +387,10 @@ static void device_found(PDEVICE_OBJECT devobj, PFILE_OBJECT fileobj, PUNICODE_S
                 if (sd->array_info.level == RAID_LEVEL_0 || sd->array_info.level == RAID_LEVEL_LINEAR)
                     sd->array_size += sb->disk_info.data_size * 512;
 
-                if (sd->found_devices == sd->array_info.raid_disks)
+                if (sd->found_devices == sd->array_info.raid_disks) {
+                    sd->init_partial_chunks();
                     sd->loaded = true;
+                }
             }
 
             return;
@@ -456,6 +487,15 @@ static void device_found(PDEVICE_OBJECT devobj, PFILE_OBJECT fileobj, PUNICODE_S
     RtlCopyMemory(&sd->array_state, &sb->array_state, sizeof(sb->array_state));
     RtlCopyMemory(&sd->roles, &sb->roles, sizeof(sb->roles));
 
+    {
+        uint32_t max_ctxs = sd->array_info.raid_disks;
+
+        if (sd->array_info.level == RAID_LEVEL_10)
+            max_ctxs *= (sd->array_info.layout >> 8) & 0xff;
+
+        sd->pool.init(sd->stack_size, max_ctxs);
+    }
+
     if (sb->array_info.level == RAID_LEVEL_4 || sb->array_info.level == RAID_LEVEL_5 || sb->array_info.level == RAID_LEVEL_6) {
         Status = PsCreateSystemThread(&sd->flush_thread_handle, 0, nullptr, nullptr, nullptr, flush_thread, sd);
         if (!NT_SUCCESS(Status)) {
@@ -482,8 +522,10 @@ static void device_found(PDEVICE_OBJECT devobj, PFILE_OBJECT fileobj, PUNICODE_S
             sd->found_devices++;
             sd->child_list[sd->roles.dev_roles[sb->disk_info.dev_number]] = c;
 
-            if (sd->found_devices == sd->array_info.raid_disks)
+            if (sd->found_devices == sd->array_info.raid_disks) {
+                sd->init_partial_chunks();
                 sd->loaded = true;
+            }
         }
     }
 
@@ -641,6 +683,20 @@ void set_pdo::child_removed(set_child* sc) {
         loaded = false;
     }
 
+    // Gathered writes hold a rundown reference until the flush thread gets to them, so fail
+    // them now rather than wait. Writers hold the lock while copying into a gather, so with it
+    // held exclusively they're all ready to go.
+    if (!loaded)
+        flush_gathers(true);
+
+    // Requests don't hold the lock while they're in flight, so wait for them to finish before
+    // freeing the member. New ones fail while we're waiting.
+    ExReleaseResourceLite(&lock);
+    ExWaitForRundownProtectionRelease(&io_rundown);
+    KeWaitForSingleObject(&write_behind_idle, Executive, KernelMode, false, nullptr);
+    ExAcquireResourceExclusiveLite(&lock, true);
+    ExReInitializeRundownProtection(&io_rundown);
+
     RemoveEntryList(&sc->list_entry);
 
     sc->set_child::~set_child();
@@ -772,6 +828,15 @@ static void __stdcall DriverUnload(PDRIVER_OBJECT DriverObject) {
 
     ExDeleteResourceLite(&dev_lock);
 
+    stop_flush_workers();
+    stop_parity_workers();
+
+    if (low_memory_event)
+        ZwClose(low_memory_handle);
+
+    if (registry_path.Buffer)
+        ExFreePool(registry_path.Buffer);
+
 #ifdef _DEBUG
     if (logger)
         delete logger;
@@ -1002,6 +1067,8 @@ NTSTATUS set_pdo::shutdown(PIRP Irp) {
             flush_chunks();
     }
 
+    KeWaitForSingleObject(&write_behind_idle, Executive, KernelMode, false, nullptr);
+
     // FIXME - mark superblocks as clean(?)
 
     return STATUS_SUCCESS;
@@ -1141,15 +1208,51 @@ NTSTATUS drv_power(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
 }
 
 static void check_cpu() {
+    bool have_avx;
+
 #ifndef _MSC_VER
     unsigned int cpuInfo[4];
     __get_cpuid(1, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3]);
     have_sse2 = cpuInfo[3] & bit_SSE2;
+    have_avx = cpuInfo[2] & bit_AVX;
+
+    if (__get_cpuid_count(7, 0, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3])) {
+        have_avx2 = cpuInfo[1] & bit_AVX2;
+        have_avx512f = cpuInfo[1] & bit_AVX512F;
+        have_avx512bw = cpuInfo[1] & bit_AVX512BW;
+    }
 #else
     int cpuInfo[4];
    __cpuid(cpuInfo, 1);
    have_sse2 = cpuInfo[3] & (1 << 26);
+   have_avx = cpuInfo[2] & (1 << 28);
+
+   __cpuid(cpuInfo, 0);
+
+   if (cpuInfo[0] >= 7) {
+       __cpuidex(cpuInfo, 7, 0);
+       have_avx2 = cpuInfo[1] & (1 << 5);
+       have_avx512f = cpuInfo[1] & (1 << 16);
+       have_avx512bw = cpuInfo[1] & (1 << 30);
+   }
 #endif
+
+    // the CPU supporting them isn't enough - the OS has to have enabled the registers too
+
+    auto features = RtlGetEnabledExtendedFeatures((ULONG64)-1);
+
+    if (!have_avx || !(features & XSTATE_MASK_AVX))
+        have_avx2 = have_avx512f = have_avx512bw = false;
+
+    if ((features & XSTATE_MASK_AVX512) != XSTATE_MASK_AVX512)
+        have_avx512f = have_avx512bw = false;
+
+    if (!have_avx512f)
+        have_avx512bw = false;
+
+    TRACE("SSE2: %u, AVX2: %u, AVX-512F: %u, AVX-512BW: %u\n", have_sse2, have_avx2, have_avx512f, have_avx512bw);
+
+    init_simd();
 }
 
 static NTSTATUS drv_close(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
@@ -1237,9 +1340,184 @@ void read_registry(PUNICODE_STRING regpath) {
     get_registry_value(h, L"DebugLogLevel", REG_DWORD, &debug_log_level, sizeof(debug_log_level));
 #endif
 
+    get_registry_value(h, L"ParityThreads", REG_DWORD, &parity_threads, sizeof(parity_threads));
+    get_registry_value(h, L"StripeCacheSize", REG_DWORD, &stripe_cache_size, sizeof(stripe_cache_size));
+    get_registry_value(h, L"FlushInterval", REG_DWORD, &flush_interval, sizeof(flush_interval));
+    get_registry_value(h, L"FlushIdleTime", REG_DWORD, &flush_idle_time, sizeof(flush_idle_time));
+    get_registry_value(h, L"FlushMaxAge", REG_DWORD, &flush_max_age, sizeof(flush_max_age));
+    get_registry_value(h, L"FlushDirtyPercent", REG_DWORD, &flush_dirty_percent, sizeof(flush_dirty_percent));
+    get_registry_value(h, L"FlushBatch", REG_DWORD, &flush_batch, sizeof(flush_batch));
+    get_registry_value(h, L"FlushStripes", REG_DWORD, &flush_stripes, sizeof(flush_stripes));
+    get_registry_value(h, L"WriteGatherTime", REG_DWORD, &write_gather_time, sizeof(write_gather_time));
+    get_registry_value(h, L"ReadAheadStripes", REG_DWORD, &read_ahead_stripes, sizeof(read_ahead_stripes));
+    get_registry_value(h, L"ReadAheadCacheSize", REG_DWORD, &read_ahead_cache_size, sizeof(read_ahead_cache_size));
+    get_registry_value(h, L"Raid1SplitSize", REG_DWORD, &raid1_split_size, sizeof(raid1_split_size));
+    get_registry_value(h, L"WriteBehindSize", REG_DWORD, &write_behind_size, sizeof(write_behind_size));
+
+    if (flush_interval == 0)
+        flush_interval = 1;
+
+    if (flush_batch == 0)
+        flush_batch = 1;
+
     ZwClose(h);
 }
 
+static NTSTATUS create_volatile_key(HANDLE* h, HANDLE parent, PUNICODE_STRING name) {
+    OBJECT_ATTRIBUTES oa;
+    ULONG dispos;
+
+    InitializeObjectAttributes(&oa, name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, parent, NULL);
+
+    return ZwCreateKey(h, KEY_SET_VALUE | KEY_CREATE_SUB_KEY, &oa, 0, NULL, REG_OPTION_VOLATILE, &dispos);
+}
+
+// The benchmark results go in Parity\<op> under our service key, which is volatile
+// so that stale results don't outlive a reboot onto different hardware.
+static void save_simd_results(PUNICODE_STRING regpath) {
+    NTSTATUS Status;
+    HANDLE h, h2;
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING us;
+
+    InitializeObjectAttributes(&oa, regpath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    Status = ZwOpenKey(&h, KEY_CREATE_SUB_KEY, &oa);
+    if (!NT_SUCCESS(Status)) {
+        ERR("ZwOpenKey returned %08x\n", Status);
+        return;
+    }
+
+    RtlInitUnicodeString(&us, L"Parity");
+
+    Status = create_volatile_key(&h2, h, &us);
+
+    ZwClose(h);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("ZwCreateKey returned %08x\n", Status);
+        return;
+    }
+
+    for (unsigned int i = 0; i < SIMD_OPS; i++) {
+        HANDLE h3;
+
+        if (!simd_results[i].op)
+            continue;
+
+        RtlInitUnicodeString(&us, simd_results[i].op);
+
+        Status = create_volatile_key(&h3, h2, &us);
+        if (!NT_SUCCESS(Status)) {
+            ERR("ZwCreateKey returned %08x\n", Status);
+            continue;
+        }
+
+        RtlInitUnicodeString(&us, L"Algorithm");
+
+        Status = ZwSetValueKey(h3, &us, 0, REG_SZ, (void*)simd_results[i].impl, (ULONG)((wcslen(simd_results[i].impl) + 1) * sizeof(WCHAR)));
+        if (!NT_SUCCESS(Status))
+            ERR("ZwSetValueKey returned %08x\n", Status);
+
+        RtlInitUnicodeString(&us, L"Speed");
+
+        Status = ZwSetValueKey(h3, &us, 0, REG_DWORD, &simd_results[i].speed, sizeof(uint32_t));
+        if (!NT_SUCCESS(Status))
+            ERR("ZwSetValueKey returned %08x\n", Status);
+
+        ZwClose(h3);
+    }
+
+    ZwClose(h2);
+}
+
+// The flush counters go in Stats\<set uuid> under our service key, volatile like Parity, so that
+// they can be looked at on release builds, which don't have TRACE. The flush thread calls this.
+void set_pdo::save_flush_stats() {
+    NTSTATUS Status;
+    HANDLE h, h2, h3;
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING us;
+    WCHAR name[37];
+
+    if (!registry_path.Buffer)
+        return;
+
+    flush_counters stats = flush_stats;
+
+    if (RtlCompareMemory(&stats, &saved_flush_stats, sizeof(flush_counters)) == sizeof(flush_counters))
+        return;
+
+    InitializeObjectAttributes(&oa, &registry_path, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    Status = ZwOpenKey(&h, KEY_CREATE_SUB_KEY, &oa);
+    if (!NT_SUCCESS(Status)) {
+        ERR("ZwOpenKey returned %08x\n", Status);
+        return;
+    }
+
+    RtlInitUnicodeString(&us, L"Stats");
+
+    Status = create_volatile_key(&h2, h, &us);
+
+    ZwClose(h);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("ZwCreateKey returned %08x\n", Status);
+        return;
+    }
+
+    auto p = name;
+    for (uint8_t i = 0; i < 16; i++) {
+        *p = hex_digit((array_info.set_uuid[i] & 0xf0) >> 4); p++;
+        *p = hex_digit(array_info.set_uuid[i] & 0xf); p++;
+
+        if (i == 3 || i == 5 || i == 7 || i == 9) {
+            *p = L'-'; p++;
+        }
+    }
+    *p = 0;
+
+    RtlInitUnicodeString(&us, name);
+
+    Status = create_volatile_key(&h3, h2, &us);
+
+    ZwClose(h2);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("ZwCreateKey returned %08x\n", Status);
+        return;
+    }
+
+    const struct {
+        const WCHAR* name;
+        LONG64 value;
+    } values[] = {
+        { L"Passes", stats.passes },
+        { L"Full", stats.full },
+        { L"Idle", stats.idle },
+        { L"Aged", stats.aged },
+        { L"Dirty", stats.dirty },
+        { L"Evicted", stats.evicted },
+        { L"Busy", stats.busy },
+        { L"Dropped", stats.dropped },
+        { L"Gathered", stats.gathered },
+        { L"GatherExpired", stats.gather_expired },
+    };
+
+    for (const auto& v : values) {
+        RtlInitUnicodeString(&us, v.name);
+
+        Status = ZwSetValueKey(h3, &us, 0, REG_QWORD, (void*)&v.value, sizeof(LONG64));
+        if (!NT_SUCCESS(Status))
+            ERR("ZwSetValueKey returned %08x\n", Status);
+    }
+
+    ZwClose(h3);
+
+    saved_flush_stats = stats;
+}
+
 NTSTATUS device::system_control(PIRP Irp, bool*) {
     return Irp->IoStatus.Status;
 }
@@ -1305,6 +1583,13 @@ extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Reg
 
     read_registry(RegistryPath);
 
+    registry_path.Buffer = (WCHAR*)ExAllocatePoolWithTag(PagedPool, RegistryPath->Length, ALLOC_TAG);
+    if (registry_path.Buffer) {
+        RtlCopyMemory(registry_path.Buffer, RegistryPath->Buffer, RegistryPath->Length);
+        registry_path.Length = registry_path.MaximumLength = RegistryPath->Length;
+    } else
+        ERR("out of memory\n");
+
 #ifdef _DEBUG
     if (debug_log_level > 0)
         logger = new serial_logger;
@@ -1313,6 +1598,18 @@ extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Reg
     TRACE("(%p, %.*S)\n", DriverObject, RegistryPath->Length / sizeof(WCHAR), RegistryPath->Buffer);
 
     check_cpu();
+    benchmark_simd();
+    save_simd_results(RegistryPath);
+
+    {
+        UNICODE_STRING us;
+
+        RtlInitUnicodeString(&us, L"\\KernelObjects\\LowNonPagedPoolCondition");
+
+        low_memory_event = IoCreateNotificationEvent(&us, &low_memory_handle);
+        if (!low_memory_event)
+            WARN("IoCreateNotificationEvent failed\n");
+    }
 
     UNICODE_STRING device_nameW;
 
@@ -1385,5 +1682,8 @@ extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Reg
         return Status;
     }
 
+    start_parity_workers();
+    start_flush_workers();
+
     return STATUS_SUCCESS;
 }
@@ -70,8 +70,15 @@ extern serial_logger* logger;
 #define FILE_DEVICE_ALLOW_APPCONTAINER_TRAVERSAL 0x00020000
 #endif
 
+#ifndef XSTATE_MASK_AVX512
+#define XSTATE_MASK_AVX512 ((1ull << 5) | (1ull << 6) | (1ull << 7))
+#endif
+
 extern uint32_t debug_log_level;
 extern bool have_sse2;
+extern bool have_avx2;
+extern bool have_avx512f;
+extern bool have_avx512bw;
 
 #ifdef _DEBUG
 #define ERR(s, ...) do { if (logger && debug_log_level > 0) { logger->log(funcname, s, ##__VA_ARGS__); } } while (0);
@@ -157,6 +164,8 @@ __inline static uint32_t sector_align(uint32_t n, uint32_t a) {
 #define RAID_LAYOUT_LEFT_SYMMETRIC      2
 #define RAID_LAYOUT_RIGHT_SYMMETRIC     3
 
+#define MD_DEVFLAG_WRITE_MOSTLY         1
+
 #pragma pack(push,1)
 
 struct mdraid_disk_info {
@@ -348,6 +357,8 @@ public:
     NTSTATUS Status = STATUS_SUCCESS;
 };
 
+#define MAX_TIMED_COPIES 32 // members or copies past this are never avoided for being slow
+
 class set_child {
 public:
     set_child(PDEVICE_OBJECT device, PFILE_OBJECT fileobj, PUNICODE_STRING devpath, mdraid_disk_info* disk_info);
@@ -359,18 +370,227 @@ public:
     UNICODE_STRING devpath;
     LIST_ENTRY list_entry;
     NTSTATUS Status;
+    LONG reads_in_flight = 0; // RAID1 and RAID10 only
+    LONG64 head_pos = 0; // where the last read we sent it ended
+    LONG latency_ewma = 0; // of reads, in microseconds
+    LONG depth_ewma = 0; // reads in flight, in sixteenths
+    bool faulty = false; // missed a write, so mustn't be read from
+
+    void read_done(uint64_t start_time);
+    uint32_t service_time();
+    void passed_over();
+
+    static bool slow(uint32_t time, uint32_t fastest);
 };
 
+// for timing reads we pass straight down to a member
+struct member_io {
+    class set_pdo* sd;
+    set_child* sc;
+    uint64_t start_time;
+};
+
+#define PARTIAL_CHUNK_BUCKETS 1024
+#define MAX_FLUSH_STRIPES 32
+
 struct partial_chunk {
-    LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry; // in partial_chunks, oldest first
+    LIST_ENTRY hash_entry;
+    ERESOURCE lock;
+    LONG refcount;
+    bool dead; // taken out of the cache
+    uint32_t alloc_size;
     uint64_t offset;
+    uint64_t first_write; // interrupt time
+    uint64_t last_write;
     RTL_BITMAP bmp;
+    bool written_through; // some of the data's already on disk, so RMW can't be used
+    alignas(16) uint8_t data[1];
+};
+
+struct stripe_lock {
+    LIST_ENTRY list_entry;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct partial_chunk_bucket {
+    KSPIN_LOCK lock;
+    LIST_ENTRY list;
+};
+
+#define MAX_WRITE_GATHERS 16
+#define MAX_READ_STREAMS 8
+
+struct read_stream {
+    uint64_t next; // where the next read will start, if it's sequential
+    uint32_t hits;
+    uint64_t last_used;
+};
+
+struct write_behind {
+    LIST_ENTRY list_entry; // in write_behind_queue or write_behind_active
+    LIST_ENTRY ready_entry;
+    class set_pdo* sd;
+    set_child* sc;
+    uint64_t offset; // on the array
+    uint32_t length;
+    PIRP Irp;
+    class io_parent* parent; // if the request has to wait for us
+    bool copied; // data holds a copy of what we're writing
     alignas(16) uint8_t data[1];
 };
 
+struct read_ahead_entry {
+    LIST_ENTRY list_entry;
+    uint64_t offset;
+    uint32_t length;
+    LONG refcount; // one belongs to the cache
+    bool ready;
+    bool dead; // no longer in the cache
+    alignas(16) uint8_t data[1];
+};
+
+struct write_gather {
+    LIST_ENTRY list_entry;
+    uint64_t offset; // of the stripe
+    uint64_t deadline; // interrupt time
+    LIST_ENTRY irps; // in order of arrival
+    RTL_BITMAP bmp; // clear bits are the sectors we've been sent
+    uint32_t copying; // writes still copying their data in
+    bool full;
+    bool closed; // taken off gathers, and waiting for copying to reach zero
+    alignas(16) uint8_t data[1];
+};
+
+struct flush_counters {
+    LONG64 passes;
+    LONG64 full; // completed by a write
+    LONG64 idle;
+    LONG64 aged;
+    LONG64 dirty; // cache above FlushDirtyPercent
+    LONG64 evicted; // cache above StripeCacheSize
+    LONG64 busy; // skipped because something else had it locked
+    LONG64 dropped; // overwritten by a full-stripe write
+    LONG64 gathered; // written whole from gathered writes
+    LONG64 gather_expired; // gathered writes sent on their own
+};
+
 class io_context;
+class io_parent;
 class set_pdo;
 
+#define IO_POOL_DEPTH 4 // spare child IRPs kept per context slot
+#define PARITY_POOL_MIN 65536 // smallest size class of parity buffer kept by io_pool
+#define PARITY_POOL_CLASSES 3 // each twice the size of the one before
+#define PARITY_POOL_DEPTH 4 // spare parity buffers kept per size class
+
+// Child IRPs, context arrays and io_parents kept between requests, so that the
+// I/O path doesn't need to go to the pool allocator. If the pool is empty we
+// allocate as before, and anything beyond the limit is freed rather than kept.
+class io_pool {
+public:
+    io_pool() {
+        KeInitializeSpinLock(&irp_lock);
+        InitializeListHead(&irps);
+        KeInitializeSpinLock(&parity_lock);
+
+        for (unsigned int i = 0; i < PARITY_POOL_CLASSES; i++) {
+            InitializeListHead(&parity_bufs[i]);
+        }
+    }
+
+    ~io_pool();
+
+    void init(CCHAR stack_size, uint32_t max_ctxs);
+    PIRP get_irp(io_context& ctx);
+    void put_irp(PIRP Irp);
+    io_context* get_ctxs(uint32_t num);
+    void* get_parent(size_t size);
+    static void put(void* p);
+    uint8_t* get_parity(uint32_t length);
+    void put_parity(uint8_t* buf, uint32_t length);
+    member_io* get_member_io();
+
+private:
+    bool initialized = false;
+    CCHAR irp_stack_size = 0;
+    KSPIN_LOCK irp_lock;
+    LIST_ENTRY irps;
+    LONG num_irps = 0;
+    LONG max_irps = 0;
+    uint32_t max_ctxs = 0;
+    NPAGED_LOOKASIDE_LIST ctxs_lookaside;
+    NPAGED_LOOKASIDE_LIST parent_lookaside;
+    NPAGED_LOOKASIDE_LIST member_io_lookaside;
+    KSPIN_LOCK parity_lock;
+    LIST_ENTRY parity_bufs[PARITY_POOL_CLASSES];
+    LONG num_parity_bufs[PARITY_POOL_CLASSES] = {};
+};
+
+#define PARITY_SLICE 65536 // most bytes of parity a worker thread does at a time
+
+#define MAX_WORKER_THREADS 64
+
+struct worker_job {
+    LIST_ENTRY list_entry;
+    void (*func)(worker_job* job);
+};
+
+// Threads of our own which run jobs off a queue, rather than tying up the system's work queues
+// with things that block. Whoever queues jobs should take them back off with dequeue while
+// they're waiting, rather than sitting idle. Only used as a global, so starts off zeroed.
+class worker_pool {
+public:
+    void start(uint32_t num);
+    void stop();
+    void queue(LIST_ENTRY* list, uint32_t num);
+    worker_job* dequeue();
+
+    uint32_t num_workers;
+
+private:
+    static void worker(void* context);
+
+    KSPIN_LOCK lock;
+    LIST_ENTRY jobs;
+    KSEMAPHORE sem;
+    bool stopping;
+    PKTHREAD threads[MAX_WORKER_THREADS];
+};
+
+class parity_batch;
+
+struct parity_job : worker_job {
+    parity_batch* batch;
+    uint32_t num;
+    uint8_t** srcs;
+    uint8_t* p;
+    uint8_t* q; // if null, p is just the XOR of srcs
+    uint32_t off;
+    uint32_t end;
+};
+
+// A set of parity calculations, which run() hands out to the worker threads and waits
+// for. The buffers passed to add() have to stay valid until then. length is roughly how
+// many bytes of parity will be added, which is used to size the job array.
+class parity_batch {
+public:
+    parity_batch(uint32_t length);
+    ~parity_batch();
+
+    void add(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* p, uint8_t* q);
+    void run();
+
+    LONG outstanding = 0;
+    KEVENT Event;
+
+private:
+    parity_job* jobs = nullptr;
+    uint32_t max_jobs = 0;
+    uint32_t num_jobs = 0;
+};
+
 template<POOL_TYPE PoolType>
 class kernel_buffer {
 public:
@@ -412,6 +632,10 @@ public:
     PDEVICE_OBJECT attached_device;
     LONG open_count = 0;
     ERESOURCE lock;
+
+private:
+    NTSTATUS read_set(PIRP Irp, bool* no_complete);
+    NTSTATUS write_set(PIRP Irp, bool* no_complete);
 };
 
 class set_pdo : device {
@@ -424,8 +648,12 @@ public:
     NTSTATUS pnp(PIRP Irp, bool* no_complete) override;
     NTSTATUS shutdown(PIRP Irp) override;
     void flush_thread();
+    void save_flush_stats();
+    void init_partial_chunks();
     void child_removed(set_child* sc);
     NTSTATUS AddDevice();
+    void lock_stripes(stripe_lock* sl, uint64_t offset, uint64_t length);
+    void unlock_stripes(stripe_lock* sl);
 
     friend set_device;
 
@@ -444,13 +672,43 @@ public:
     uint8_t stack_size = 0;
     uint16_t dev_sector_size = 0;
     LIST_ENTRY children;
-    ERESOURCE partial_chunks_lock;
+    KSPIN_LOCK partial_chunks_lock; // for partial_chunks and partial_chunks_size
     LIST_ENTRY partial_chunks;
+    partial_chunk_bucket partial_chunk_hash[PARTIAL_CHUNK_BUCKETS];
+    uint64_t partial_chunks_size = 0;
+    KSPIN_LOCK stripe_locks_lock;
+    LIST_ENTRY stripe_locks;
+    KEVENT stripe_unlocked;
+    uint32_t pc_block = 512; // bytes covered by each bit of a partial chunk's bitmap
+    uint32_t pc_rows = 0; // bits per column
     LIST_ENTRY list_entry;
     HANDLE flush_thread_handle = nullptr;
     KTIMER flush_thread_timer;
+    KEVENT flush_thread_wake;
+    KTIMER gather_timer;
+    KSPIN_LOCK gather_lock;
+    LIST_ENTRY gathers; // oldest first
+    LIST_ENTRY ready_gathers; // closed, for the flush thread to send on
+    uint32_t num_gathers = 0;
+    LONG writes_in_flight = 0; // RAID0/4/5/6/10 only
+    EX_RUNDOWN_REF io_rundown; // held by anything which might use a member, see child_removed
+    KSPIN_LOCK read_ahead_lock; // for read_ahead, read_ahead_size and streams
+    LIST_ENTRY read_ahead; // least recently used first
+    uint64_t read_ahead_size = 0;
+    read_stream streams[MAX_READ_STREAMS] = {};
+    uint64_t stream_clock = 0;
+    KSPIN_LOCK write_behind_lock; // for everything write_behind
+    LIST_ENTRY write_behind_queue; // oldest first
+    LIST_ENTRY write_behind_active;
+    uint64_t write_behind_bytes = 0; // copied and not yet written
+    uint32_t write_behind_count = 0;
+    KEVENT write_behind_idle;
+    LONG64 last_write_end = -1;
     KEVENT flush_thread_finished;
+    flush_counters flush_stats = {};
+    flush_counters saved_flush_stats = {}; // as last written to the registry
     bool readonly = false;
+    io_pool pool;
     UNICODE_STRING bus_name;
 
 private:
@@ -461,6 +719,17 @@ private:
     NTSTATUS disk_get_length_info(PIRP Irp);
     NTSTATUS read_raid0(PIRP Irp, bool* no_complete);
     NTSTATUS read_raid1(PIRP Irp, bool* no_complete);
+    set_child* choose_mirror(uint64_t offset);
+    bool write_mostly(uint32_t disk);
+    bool split_member(uint32_t disk, const uint32_t* times, uint32_t fastest_disk);
+    uint32_t choose_copy(uint64_t base, uint32_t copies, uint64_t step = 0, uint32_t num = 1);
+    uint32_t copy_time(uint64_t base, uint32_t copy, uint64_t step, uint32_t num, set_child** slowest);
+    void time_read(PIRP Irp, set_child* sc);
+    NTSTATUS read_raid1_split(PIRP Irp, bool* no_complete, uint32_t readable, const uint32_t* times, uint32_t fastest_disk);
+    NTSTATUS queue_write_behind(io_parent* parent, set_child* sc);
+    void start_write_behinds();
+    void finish_write_behind(write_behind* wb);
+    static NTSTATUS __stdcall write_behind_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx);
     NTSTATUS read_raid45(PIRP Irp, bool* no_complete);
     NTSTATUS read_raid6(PIRP Irp, bool* no_complete);
     NTSTATUS read_raid10(PIRP Irp, bool* no_complete);
@@ -468,22 +737,57 @@ private:
     NTSTATUS read_raid10_offset(PIRP Irp, bool* no_complete);
     NTSTATUS read_linear(PIRP Irp, bool* no_complete);
     NTSTATUS write_raid0(PIRP Irp, bool* no_complete);
-    NTSTATUS write_raid1(PIRP Irp);
+    NTSTATUS write_raid1(PIRP Irp, bool* no_complete);
     NTSTATUS write_raid45(PIRP Irp, bool* no_complete);
     NTSTATUS write_raid6(PIRP Irp, bool* no_complete);
-    NTSTATUS write_raid10(PIRP Irp);
-    NTSTATUS write_raid10_odd(PIRP Irp);
-    NTSTATUS write_raid10_offset(PIRP Irp);
+    NTSTATUS write_raid10(PIRP Irp, bool* no_complete);
+    NTSTATUS write_raid10_odd(PIRP Irp, bool* no_complete);
+    NTSTATUS write_raid10_offset(PIRP Irp, bool* no_complete);
     NTSTATUS write_raid10_offset_partial(klist<io_context>& ctxs, uint64_t offset, uint32_t length, PFN_NUMBER* src_pfns, uint32_t mdl_offset);
     NTSTATUS write_linear(PIRP Irp, bool* no_complete);
-    NTSTATUS add_partial_chunk(uint64_t offset, uint32_t length, void* data);
+    NTSTATUS add_partial_chunk(uint64_t offset, uint32_t length, void* data, bool write_back);
+    partial_chunk_bucket* find_bucket(uint64_t chunk_offset);
+    partial_chunk* find_partial_chunk(uint64_t chunk_offset);
+    void put_partial_chunk(partial_chunk* pc);
+    void remove_partial_chunk(partial_chunk* pc);
+    NTSTATUS write_partial_chunk(partial_chunk* pc, uint32_t offset, uint32_t length, void* data);
+    uint32_t lock_for_flush(partial_chunk** pcs, uint32_t num, bool wait, LONG64** counters = nullptr);
+    void drop_partial_chunks(uint64_t offset, uint64_t length);
+    bool gather_write(PIRP Irp);
+    void flush_gathers(bool all);
+    void close_gather(write_gather* g, bool full);
+    void finish_gather(write_gather* g, bool full);
+    NTSTATUS write_full_stripe(uint64_t offset, uint8_t* data);
+    uint32_t read_ahead_width();
+    bool read_ahead_hit(PIRP Irp);
+    void start_read_ahead(uint64_t offset, uint32_t width);
+    static void read_ahead_worker(PDEVICE_OBJECT, PVOID context);
+    void invalidate_read_ahead(uint64_t offset, uint64_t length);
+    read_ahead_entry* find_read_ahead(uint64_t offset);
+    void drop_read_ahead(read_ahead_entry* ra);
+    void put_read_ahead(read_ahead_entry* ra);
+    void trim_partial_chunks(partial_chunk* keep);
+    bool read_partial_chunks(PIRP Irp, uint64_t offset, uint32_t length);
     NTSTATUS flush_partial_chunk(partial_chunk* pc);
+    NTSTATUS flush_locked_chunk(partial_chunk* pc);
     NTSTATUS flush_partial_chunk_raid45(partial_chunk* pc, RTL_BITMAP* valid_bmp);
+    NTSTATUS flush_partial_chunk_raid45_rmw(partial_chunk* pc, RTL_BITMAP* valid_bmp);
     NTSTATUS flush_partial_chunk_raid6(partial_chunk* pc, RTL_BITMAP* valid_bmp);
+    NTSTATUS flush_partial_chunk_raid6_rmw(partial_chunk* pc, RTL_BITMAP* valid_bmp);
+    bool rmw_cheaper(partial_chunk* pc, RTL_BITMAP* valid_bmp);
+    NTSTATUS add_parity_ctxs(klist<io_context>& ctxs, partial_chunk* pc, RTL_BITMAP* valid_bmp, uint8_t* p, uint8_t* q);
+    NTSTATUS add_block_ctxs(klist<io_context>& ctxs, partial_chunk* pc, uint32_t offset, uint32_t length, bool written, uint8_t* buf);
+    NTSTATUS read_old_data(partial_chunk* pc, uint32_t offset, uint32_t length, uint8_t* buf);
+    NTSTATUS sync_io(klist<io_context>& ctxs, bool write);
     void flush_chunks();
+    void flush_idle_chunks();
+    void flush_partial_chunks(partial_chunk** pcs, uint32_t num);
+    static void flush_worker(worker_job* job);
     uint32_t get_parity_volume(uint64_t offset);
     uint32_t get_physical_stripe(uint32_t stripe, uint32_t parity);
-    NTSTATUS io_linear2(PIRP Irp, uint64_t offset, uint32_t start_disk, bool write);
+    uint32_t get_syndrome_index(uint32_t parity, uint32_t stripe);
+    void get_syndrome_order(uint32_t parity, uint8_t* base, uint32_t stride, uint8_t** data);
+    NTSTATUS io_linear2(PIRP Irp, uint64_t offset, uint32_t start_disk, bool write, bool* no_complete);
     NTSTATUS query_hardware_ids(PIRP Irp);
     NTSTATUS query_device_ids(PIRP Irp);
 #ifdef DEBUG_PARANOID
@@ -534,11 +838,73 @@ static __inline void get_raid0_offset(uint64_t off, uint64_t stripe_length, uint
 bool is_top_level(PIRP Irp);
 
 // io.cpp
+extern uint32_t stripe_cache_size;
+extern uint32_t flush_interval;
+extern uint32_t flush_idle_time;
+extern uint32_t flush_max_age;
+extern uint32_t flush_dirty_percent;
+extern uint32_t flush_batch;
+extern uint32_t flush_stripes;
+extern uint32_t write_gather_time;
+extern uint32_t read_ahead_stripes;
+extern uint32_t read_ahead_cache_size;
+extern uint32_t raid1_split_size;
+extern uint32_t write_behind_size;
+extern PKEVENT low_memory_event;
+
 NTSTATUS drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS drv_write(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 void flush_thread(void* context);
+void start_flush_workers();
+void stop_flush_workers();
 NTSTATUS __stdcall io_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx);
+NTSTATUS __stdcall write_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx);
+NTSTATUS __stdcall passthrough_completion(PDEVICE_OBJECT, PIRP Irp, PVOID ctx);
+
+// simd.cpp
+struct simd_funcs {
+    void (*xor_func)(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+    void (*and_func)(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+    void (*galois_double_func)(uint8_t* data, uint32_t len);
+    void (*gen_syndrome_func)(uint32_t num, uint32_t off, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q);
+    void (*xor_blocks_func)(uint32_t num, uint32_t off, uint32_t end, uint8_t** srcs, uint8_t* dest);
+    void (*galois_mul_xor_func)(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len);
+    ULONG64 xstate_mask;
+};
+
+enum {
+    SIMD_OP_XOR,
+    SIMD_OP_AND,
+    SIMD_OP_GALOIS_DOUBLE,
+    SIMD_OP_GEN_SYNDROME,
+    SIMD_OP_XOR_BLOCKS,
+    SIMD_OP_GALOIS_MUL_XOR,
+    SIMD_OPS
+};
+
+struct simd_result {
+    const WCHAR* op;
+    const WCHAR* impl;
+    uint32_t speed; // MB/s
+};
+
+extern simd_funcs simd;
+extern simd_result simd_results[SIMD_OPS];
+
+void init_simd();
+void benchmark_simd();
 void do_xor(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+void do_and(uint8_t* buf1, uint8_t* buf2, uint32_t len);
+void galois_double(uint8_t* data, uint32_t len);
+void gen_syndrome(uint32_t num, uint32_t end, uint8_t** data, uint8_t* p, uint8_t* q, uint32_t off = 0);
+void xor_blocks(uint32_t num, uint32_t end, uint8_t** srcs, uint8_t* dest, uint32_t off = 0);
+void galois_mul_xor(uint8_t* dest, uint8_t* src, uint8_t c, uint32_t len);
+
+// parity.cpp
+extern uint32_t parity_threads;
+
+void start_parity_workers();
+void stop_parity_workers();
 
 // pnp.cpp
 NTSTATUS drv_pnp(PDEVICE_OBJECT DeviceObject, PIRP Irp);
@@ -548,8 +914,8 @@ class io_context {
 public:
     io_context() { }
 
-    io_context(set_child* sc, uint64_t stripe_start, uint64_t stripe_end) : sc(sc), stripe_start(stripe_start), stripe_end(stripe_end) {
-        Irp = IoAllocateIrp(sc->device->StackSize, false);
+    io_context(set_child* sc, uint64_t stripe_start, uint64_t stripe_end, io_pool* pool = nullptr) : sc(sc), stripe_start(stripe_start), stripe_end(stripe_end) {
+        Irp = pool ? pool->get_irp(*this) : IoAllocateIrp(sc->device->StackSize, false);
         if (!Irp) {
             ERR("out of memory\n");
             Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -573,8 +939,12 @@ public:
         if (va)
             ExFreePool(va);
 
-        if (Irp)
-            IoFreeIrp(Irp);
+        if (Irp) {
+            if (pool)
+                pool->put_irp(Irp);
+            else
+                IoFreeIrp(Irp);
+        }
     }
 
     PIRP Irp = nullptr;
@@ -592,4 +962,67 @@ public:
     PFN_NUMBER* pfnp;
     bool first;
     uint64_t stripe_pos;
+    io_parent* parent = nullptr;
+    io_pool* pool = nullptr;
+    bool timed = false; // counted in sc->reads_in_flight
+    uint64_t start_time;
+
+    void time_read() {
+        timed = true;
+        start_time = KeQueryInterruptTime();
+        InterlockedIncrement(&sc->reads_in_flight);
+    }
+};
+
+// Shared by all the child IRPs of one request. Each child holds a reference,
+// as does the submitter until everything has been sent; whoever drops the last
+// one either completes Irp or, if the submitter is waiting, signals Event.
+class io_parent {
+public:
+    io_parent(PIRP Irp) : Irp(Irp) {
+        KeInitializeEvent(&Event, NotificationEvent, false);
+    }
+
+    ~io_parent();
+
+    void* operator new(size_t size, io_pool& pool);
+    void operator delete(void* p);
+    void operator delete(void* p, io_pool& pool);
+
+    NTSTATUS call(io_context& ctx);
+    void release(NTSTATUS Status);
+    NTSTATUS wait();
+    NTSTATUS pend(bool* no_complete);
+
+    PIRP Irp;
+    LONG outstanding = 1;
+    NTSTATUS Status = STATUS_SUCCESS;
+    KEVENT Event;
+    bool waiting = false;
+
+    // freed by the destructor
+    io_context* ctxs = nullptr;
+    uint32_t num_ctxs = 0;
+    klist<io_context> ctx_list;
+    io_context first_bit;
+    bool mdl_locked = true;
+    uint8_t* tmpbuf = nullptr;
+    PMDL tmpmdl = nullptr;
+    uint32_t skip_first = 0;
+    uint32_t copy_length = 0;
+    void* dummypage = nullptr;
+    PMDL dummy_mdl = nullptr;
+    uint8_t* parity_data = nullptr;
+    PMDL parity_mdl = nullptr;
+    uint8_t* q_data = nullptr;
+    PMDL q_mdl = nullptr;
+    io_pool* parity_pool = nullptr; // where parity_data and q_data came from
+    uint32_t parity_alloc = 0;
+    LONG* in_flight = nullptr; // decremented when Irp is completed
+    EX_RUNDOWN_REF* rundown = nullptr; // released when Irp is completed
+    set_pdo* locked_set = nullptr; // if set, stripes is unlocked by the destructor
+    stripe_lock stripes;
+
+private:
+    void finish();
 };